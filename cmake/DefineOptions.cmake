@@ -1,3 +1,4 @@
 option(UNIT_TESTING "Build and run unit tests" OFF)
 option(USE_LOCAL_HIDAPI "Use hidapi from local git submodule in 3rdparty/hidapi directory" ON)
+option(WITH_USDT "Add USDT tracepoints if sys/sdt.h is available" ON)
 option(CMOCKA_BIN_DIR "Directory with cmocka.dll - used for testing on Windows")
@@ -0,0 +1,161 @@
+--[[--------------------------------------------------------------------
+
+  Output coalescing test for USB HID device
+  firmware: 18F14K50/004-full-speed-hid-test
+
+  2026-10-18
+  This code is placed into PUBLIC DOMAIN
+
+  NOTE
+  - uses the full speed echo test device, see usb-hid-fullspeed-test
+  - with coalescing on, a burst of writes collapses into the newest
+    report, sent by a native writer thread once per interval; only
+    the reports actually sent are echoed, and the last echo must be
+    the last report written
+  - after coalescing is turned off, writes go out directly again
+
+----------------------------------------------------------------------]]
+
+local string = require "string"
+local sfmt, schar, srep = string.format, string.char, string.rep
+local mrnd = math.random
+
+local hid = require "luahidapi"
+
+local function print(...)
+  io.stdout:write(...)
+  io.stdout:write("\n")
+  io.stdout:flush()
+end
+
+------------------------------------------------------------------------
+-- initialize
+------------------------------------------------------------------------
+
+print("Output coalescing test for USB HID device:")
+print(sfmt("Lib VERSION %s build on %s", hid._VERSION, hid._TIMESTAMP))
+
+if hid.init() then
+  print("hid library: init")
+else
+  print("hid library: init error")
+  return
+end
+print()
+
+------------------------------------------------------------------------
+-- open test device
+------------------------------------------------------------------------
+
+--====================================================================--
+--** WARNING: Test uses Microchip's VID and a PID from MPLAB tools'  **
+--** PID range. DO NOT use outside of a laboratory/personal setting. **
+--====================================================================--
+
+local USB_DEVICE_VID = 0x04D8
+local USB_DEVICE_PID = 0x8AC2
+
+local USB_REPORT_SIZE = 64
+
+local dev = hid.open(USB_DEVICE_VID, USB_DEVICE_PID)
+if not dev then
+  print("Open: unable to open test device")
+  return
+end
+print("Open: opened test device")
+
+------------------------------------------------------------------------
+-- switch on output coalescing
+------------------------------------------------------------------------
+
+local INTERVAL_MSEC = 20
+
+if not dev:coalesce(INTERVAL_MSEC) then
+  print("Unable to set output coalescing")
+  return
+end
+print(sfmt("Coalesce: %d ms interval", INTERVAL_MSEC))
+print()
+
+------------------------------------------------------------------------
+-- test portion
+------------------------------------------------------------------------
+
+local WRITES = 100
+local SETTLE_MSEC = 200         -- time for pending reports to be sent
+local TIMEOUT_MSEC = 100
+
+local function write(tx)
+  local res = dev:write(tx)
+  if not res then
+    print("Unable to write()")
+    print("Error: "..(dev:error() or "unknown"))
+  end
+  return res
+end
+
+local tx
+for i = 1, WRITES do
+  tx = schar(i) .. srep(schar(mrnd(0,255)), USB_REPORT_SIZE - 1)
+  if not write(tx) then return end
+end
+hid.msleep(SETTLE_MSEC)
+
+local echoes, last = 0
+while true do
+  local rx = dev:read(USB_REPORT_SIZE, TIMEOUT_MSEC)
+  if not rx then
+    print("Unable to read()")
+    return
+  elseif rx == "" then
+    break
+  end
+  echoes, last = echoes + 1, rx
+end
+if last ~= tx then
+  print("Error: last echo is not the last report written")
+  return
+end
+
+local st = dev:stats()
+print(sfmt("Coalesced: %d writes, %d sent, %d merged, %d errors",
+           WRITES, st.flushed, st.merged, st.write_errors))
+if st.flushed ~= echoes or st.flushed + st.merged ~= WRITES then
+  print(sfmt("Error: %d echoes received", echoes))
+  return
+end
+
+-- writes go out directly once coalescing is off
+if not dev:coalesce(false) then
+  print("Unable to turn off output coalescing")
+  return
+end
+for i = 1, 10 do
+  tx = schar(i) .. srep(schar(mrnd(0,255)), USB_REPORT_SIZE - 1)
+  if not write(tx) then return end
+  local rx = dev:read(USB_REPORT_SIZE, TIMEOUT_MSEC)
+  if rx ~= tx then
+    print("Error: direct write not echoed")
+    return
+  end
+end
+print("Direct: 10 writes echoed")
+print()
+
+------------------------------------------------------------------------
+-- close test device
+------------------------------------------------------------------------
+
+dev:close()
+print("Close: closed test device")
+
+------------------------------------------------------------------------
+-- close hidapi library
+------------------------------------------------------------------------
+
+if hid.exit() then
+  print("hid library: exit")
+else
+  print("hid library: exit error")
+  return
+end
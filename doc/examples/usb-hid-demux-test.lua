@@ -0,0 +1,136 @@
+--[[--------------------------------------------------------------------
+
+  Report ID demultiplexing test for USB HID device
+  firmware: 18F14K50/004-full-speed-hid-test
+
+  2026-10-18
+  This code is placed into PUBLIC DOMAIN
+
+  NOTE
+  - uses the full speed echo test device, see usb-hid-fullspeed-test
+  - the device has no numbered reports, so the first byte of each
+    echoed report is what demux() sorts on; the test sends reports
+    starting with 1 and 2 and reads them back from the two queues
+  - queues are read out of order on purpose: all reports are sent
+    first, then queue 2 is drained before queue 1
+
+----------------------------------------------------------------------]]
+
+local string = require "string"
+local sfmt, schar, srep = string.format, string.char, string.rep
+local mrnd = math.random
+
+local hid = require "luahidapi"
+
+local function print(...)
+  io.stdout:write(...)
+  io.stdout:write("\n")
+  io.stdout:flush()
+end
+
+------------------------------------------------------------------------
+-- initialize
+------------------------------------------------------------------------
+
+print("Report ID demultiplexing test for USB HID device:")
+print(sfmt("Lib VERSION %s build on %s", hid._VERSION, hid._TIMESTAMP))
+
+if hid.init() then
+  print("hid library: init")
+else
+  print("hid library: init error")
+  return
+end
+print()
+
+------------------------------------------------------------------------
+-- open test device
+------------------------------------------------------------------------
+
+--====================================================================--
+--** WARNING: Test uses Microchip's VID and a PID from MPLAB tools'  **
+--** PID range. DO NOT use outside of a laboratory/personal setting. **
+--====================================================================--
+
+local USB_DEVICE_VID = 0x04D8
+local USB_DEVICE_PID = 0x8AC2
+
+local USB_REPORT_SIZE = 64
+
+local dev = hid.open(USB_DEVICE_VID, USB_DEVICE_PID)
+if not dev then
+  print("Open: unable to open test device")
+  return
+end
+print("Open: opened test device")
+
+------------------------------------------------------------------------
+-- sort first bytes 1 and 2 into their own queues
+------------------------------------------------------------------------
+
+if not dev:demux(1, {capacity = 64}) or
+   not dev:demux(2, {capacity = 64, overflow = "drop_newest"}) then
+  print("Unable to set up report ID queues")
+  return
+end
+print("Demux: queues for 1 and 2")
+print()
+
+------------------------------------------------------------------------
+-- test portion
+------------------------------------------------------------------------
+
+local ECHO_COUNT = 32           -- per queue, fits the queue capacity
+local TIMEOUT_MSEC = 2000
+
+local sent = { [1] = {}, [2] = {} }
+for i = 1, ECHO_COUNT do
+  for id = 1, 2 do
+    local tx = schar(id, i) .. srep(schar(mrnd(0,255)), USB_REPORT_SIZE - 2)
+    if not dev:write(tx) then
+      print("Unable to write()")
+      print("Error: "..(dev:error() or "unknown"))
+      return
+    end
+    sent[id][i] = tx
+  end
+end
+
+for id = 2, 1, -1 do
+  for i = 1, ECHO_COUNT do
+    local rx = dev:read(USB_REPORT_SIZE, TIMEOUT_MSEC, {id = id})
+    if not rx then
+      print("Unable to read() from queue "..id)
+      return
+    elseif rx == "" then
+      print(sfmt("Timeout on queue %d after %d reports", id, i - 1))
+      return
+    elseif rx ~= sent[id][i] then
+      print(sfmt("Error: report %d from queue %d is out of order or corrupt", i, id))
+      return
+    end
+  end
+  print(sfmt("Queue %d: %d reports in order", id, ECHO_COUNT))
+end
+
+local demux = dev:stats().demux
+print(sfmt("Overflows: queue 1 %d, queue 2 %d", demux[1] or 0, demux[2] or 0))
+print()
+
+------------------------------------------------------------------------
+-- close test device
+------------------------------------------------------------------------
+
+dev:close()
+print("Close: closed test device")
+
+------------------------------------------------------------------------
+-- close hidapi library
+------------------------------------------------------------------------
+
+if hid.exit() then
+  print("hid library: exit")
+else
+  print("hid library: exit error")
+  return
+end
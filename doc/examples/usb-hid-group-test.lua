@@ -0,0 +1,143 @@
+--[[--------------------------------------------------------------------
+
+  Group broadcast test for USB HID devices
+  firmware: 18F14K50/004-full-speed-hid-test
+
+  2026-10-18
+  This code is placed into PUBLIC DOMAIN
+
+  NOTE
+  - uses the full speed echo test device, see usb-hid-fullspeed-test
+  - opens every attached echo test device, writes the same report to
+    all of them at once with group:write(), then checks each echo
+  - per-device write times come back from group:write(); the total
+    should stay close to the slowest single device, not their sum
+
+----------------------------------------------------------------------]]
+
+local string = require "string"
+local sfmt, schar, srep = string.format, string.char, string.rep
+local mrnd = math.random
+
+local hid = require "luahidapi"
+
+local function print(...)
+  io.stdout:write(...)
+  io.stdout:write("\n")
+  io.stdout:flush()
+end
+
+------------------------------------------------------------------------
+-- initialize
+------------------------------------------------------------------------
+
+print("Group broadcast test for USB HID devices:")
+print(sfmt("Lib VERSION %s build on %s", hid._VERSION, hid._TIMESTAMP))
+
+if hid.init() then
+  print("hid library: init")
+else
+  print("hid library: init error")
+  return
+end
+print()
+
+------------------------------------------------------------------------
+-- open all test devices
+------------------------------------------------------------------------
+
+--====================================================================--
+--** WARNING: Test uses Microchip's VID and a PID from MPLAB tools'  **
+--** PID range. DO NOT use outside of a laboratory/personal setting. **
+--====================================================================--
+
+local USB_DEVICE_VID = 0x04D8
+local USB_DEVICE_PID = 0x8AC2
+
+local USB_REPORT_SIZE = 64
+
+local devs = {}
+local enum = hid.enumerate(USB_DEVICE_VID, USB_DEVICE_PID)
+if enum then
+  while true do
+    local info = enum:next()
+    if not info then break end
+    local dev = hid.open(info.path)
+    if dev then
+      devs[#devs + 1] = dev
+      print(sfmt("Open: device %d at '%s'", #devs, info.path))
+    end
+  end
+  enum:close()
+end
+if #devs == 0 then
+  print("Open: unable to open any test device")
+  return
+end
+
+local group = hid.group(devs)
+if not group then
+  print("Unable to create device group")
+  return
+end
+print(sfmt("Group: %d devices", #devs))
+print()
+
+------------------------------------------------------------------------
+-- test portion
+------------------------------------------------------------------------
+
+local BROADCASTS = 20
+local TIMEOUT_MSEC = 2000
+
+local worst = 0
+for b = 1, BROADCASTS do
+  local tx = srep(schar(mrnd(0,255), mrnd(0,255), mrnd(0,255), mrnd(0,255)),
+                  USB_REPORT_SIZE / 4)
+  local t0 = hid.clock()
+  local results, timings = group:write(0, tx)
+  if not results then
+    print("Unable to broadcast")
+    return
+  end
+  local elapsed = hid.clock() - t0
+  if elapsed > worst then worst = elapsed end
+
+  for n, dev in ipairs(devs) do
+    if not results[n] then
+      print(sfmt("Write failed on device %d: %s", n, dev:error() or "unknown"))
+      return
+    end
+    local rx = dev:read(USB_REPORT_SIZE, TIMEOUT_MSEC)
+    if rx ~= tx then
+      print(sfmt("Error: device %d did not echo broadcast %d", n, b))
+      return
+    end
+    if b == BROADCASTS then
+      print(sfmt("Device %d: last write took %.3f ms", n, timings[n]))
+    end
+  end
+end
+print(sfmt("Broadcasts: %d, slowest took %.3f ms for all devices", BROADCASTS, worst))
+print()
+
+------------------------------------------------------------------------
+-- close group and test devices
+------------------------------------------------------------------------
+
+group:close()
+for _, dev in ipairs(devs) do
+  dev:close()
+end
+print("Close: closed group and test devices")
+
+------------------------------------------------------------------------
+-- close hidapi library
+------------------------------------------------------------------------
+
+if hid.exit() then
+  print("hid library: exit")
+else
+  print("hid library: exit error")
+  return
+end
@@ -0,0 +1,128 @@
+--[[--------------------------------------------------------------------
+
+  Latest value test for USB HID device
+  firmware: 18F14K50/004-full-speed-hid-test
+
+  2026-10-18
+  This code is placed into PUBLIC DOMAIN
+
+  NOTE
+  - uses the full speed echo test device, see usb-hid-fullspeed-test
+  - in latest mode a native reader thread keeps only the newest report,
+    so a slow consumer sees current data instead of a backlog; here
+    bursts of reports are echoed and only the last one of each burst
+    is expected, with the sequence number counting all of them
+
+----------------------------------------------------------------------]]
+
+local string = require "string"
+local sfmt, schar, srep = string.format, string.char, string.rep
+local mrnd = math.random
+
+local hid = require "luahidapi"
+
+local function print(...)
+  io.stdout:write(...)
+  io.stdout:write("\n")
+  io.stdout:flush()
+end
+
+------------------------------------------------------------------------
+-- initialize
+------------------------------------------------------------------------
+
+print("Latest value test for USB HID device:")
+print(sfmt("Lib VERSION %s build on %s", hid._VERSION, hid._TIMESTAMP))
+
+if hid.init() then
+  print("hid library: init")
+else
+  print("hid library: init error")
+  return
+end
+print()
+
+------------------------------------------------------------------------
+-- open test device
+------------------------------------------------------------------------
+
+--====================================================================--
+--** WARNING: Test uses Microchip's VID and a PID from MPLAB tools'  **
+--** PID range. DO NOT use outside of a laboratory/personal setting. **
+--====================================================================--
+
+local USB_DEVICE_VID = 0x04D8
+local USB_DEVICE_PID = 0x8AC2
+
+local USB_REPORT_SIZE = 64
+
+local dev = hid.open(USB_DEVICE_VID, USB_DEVICE_PID)
+if not dev then
+  print("Open: unable to open test device")
+  return
+end
+print("Open: opened test device")
+
+------------------------------------------------------------------------
+-- switch to latest mode
+------------------------------------------------------------------------
+
+if not dev:set("latest") then
+  print("Unable to set latest mode")
+  return
+end
+print("Set: latest mode")
+print()
+
+------------------------------------------------------------------------
+-- test portion
+------------------------------------------------------------------------
+
+local BURSTS = 10
+local BURST_SIZE = 20
+local SETTLE_MSEC = 100         -- time for a burst to be echoed
+
+local last_seq = 0
+for b = 1, BURSTS do
+  local tx
+  for i = 1, BURST_SIZE do
+    tx = schar(b, i) .. srep(schar(mrnd(0,255)), USB_REPORT_SIZE - 2)
+    if not dev:write(tx) then
+      print("Unable to write()")
+      print("Error: "..(dev:error() or "unknown"))
+      return
+    end
+  end
+  hid.msleep(SETTLE_MSEC)
+
+  local rx, time, seq = dev:latest()
+  if not rx then
+    print("No report received in burst "..b)
+    return
+  elseif rx ~= tx then
+    print("Error: latest report is not the last one sent in burst "..b)
+    return
+  end
+  print(sfmt("Burst %d: latest report at %.3f ms, %d reports since last",
+             b, time, seq - last_seq))
+  last_seq = seq
+end
+print()
+
+------------------------------------------------------------------------
+-- close test device
+------------------------------------------------------------------------
+
+dev:close()
+print("Close: closed test device")
+
+------------------------------------------------------------------------
+-- close hidapi library
+------------------------------------------------------------------------
+
+if hid.exit() then
+  print("hid library: exit")
+else
+  print("hid library: exit error")
+  return
+end
@@ -0,0 +1,154 @@
+--[[--------------------------------------------------------------------
+
+  Shared memory publish test for USB HID device
+  firmware: 18F14K50/004-full-speed-hid-test
+
+  2026-10-18
+  This code is placed into PUBLIC DOMAIN
+
+  NOTE
+  - uses the full speed echo test device, see usb-hid-fullspeed-test
+  - run without arguments to publish: the echoed reports go into a
+    shared memory ring named by RING_NAME
+  - run with the argument "sub" in other processes, started while the
+    publisher runs, to read the ring; subscribers never touch the
+    device and any number of them may run
+  - not available on Windows
+
+----------------------------------------------------------------------]]
+
+local string = require "string"
+local sfmt, schar, srep = string.format, string.char, string.rep
+local mrnd = math.random
+
+local hid = require "luahidapi"
+
+local function print(...)
+  io.stdout:write(...)
+  io.stdout:write("\n")
+  io.stdout:flush()
+end
+
+------------------------------------------------------------------------
+-- initialize
+------------------------------------------------------------------------
+
+print("Shared memory publish test for USB HID device:")
+print(sfmt("Lib VERSION %s build on %s", hid._VERSION, hid._TIMESTAMP))
+
+if hid.init() then
+  print("hid library: init")
+else
+  print("hid library: init error")
+  return
+end
+print()
+
+------------------------------------------------------------------------
+-- subscriber
+------------------------------------------------------------------------
+
+local RING_NAME = "luahidapi-echo"
+local RING_CAPACITY = 1024
+local RUN_SEC = 10
+
+if arg and arg[1] == "sub" then
+  local sub = hid.subscribe(RING_NAME)
+  if not sub then
+    print("Subscribe: no ring named '"..RING_NAME.."', start the publisher first")
+    return
+  end
+  print("Subscribe: reading ring '"..RING_NAME.."'")
+
+  local count, lost, last = 0, 0, nil
+  while true do
+    local rx, time, seq = sub:read(2000)
+    if not rx then
+      print("Unable to read ring")
+      return
+    elseif rx == "" then
+      break                     -- publisher idle or gone
+    end
+    if last and seq > last + 1 then
+      lost = lost + (seq - last - 1)
+    end
+    last = seq
+    count = count + 1
+  end
+  sub:close()
+  print(sfmt("Subscribe: %d reports read, %d lost to overrun", count, lost))
+  return
+end
+
+------------------------------------------------------------------------
+-- publisher: open test device
+------------------------------------------------------------------------
+
+--====================================================================--
+--** WARNING: Test uses Microchip's VID and a PID from MPLAB tools'  **
+--** PID range. DO NOT use outside of a laboratory/personal setting. **
+--====================================================================--
+
+local USB_DEVICE_VID = 0x04D8
+local USB_DEVICE_PID = 0x8AC2
+
+local USB_REPORT_SIZE = 64
+
+local dev = hid.open(USB_DEVICE_VID, USB_DEVICE_PID)
+if not dev then
+  print("Open: unable to open test device")
+  return
+end
+print("Open: opened test device")
+
+if not dev:publish(RING_NAME, RING_CAPACITY, USB_REPORT_SIZE) then
+  print("Unable to publish ring '"..RING_NAME.."' (name in use?)")
+  return
+end
+print("Publish: ring '"..RING_NAME.."'")
+print()
+
+------------------------------------------------------------------------
+-- test portion: keep the device echoing for a while
+------------------------------------------------------------------------
+
+local TIMEOUT_MSEC = 2000
+
+local t_end = hid.clock() + RUN_SEC * 1000
+local count = 0
+while hid.clock() < t_end do
+  local tx = srep(schar(mrnd(0,255), mrnd(0,255), mrnd(0,255), mrnd(0,255)),
+                  USB_REPORT_SIZE / 4)
+  if not dev:write(tx) then
+    print("Unable to write()")
+    print("Error: "..(dev:error() or "unknown"))
+    return
+  end
+  local rx = dev:read(USB_REPORT_SIZE, TIMEOUT_MSEC)
+  if rx ~= tx then
+    print("Error: no or wrong echo from device")
+    return
+  end
+  count = count + 1
+end
+print(sfmt("Published %d reports in %d seconds", count, RUN_SEC))
+print()
+
+------------------------------------------------------------------------
+-- stop publishing, close test device
+------------------------------------------------------------------------
+
+dev:publish(false)
+dev:close()
+print("Close: removed ring, closed test device")
+
+------------------------------------------------------------------------
+-- close hidapi library
+------------------------------------------------------------------------
+
+if hid.exit() then
+  print("hid library: exit")
+else
+  print("hid library: exit error")
+  return
+end
@@ -0,0 +1,168 @@
+--[[--------------------------------------------------------------------
+
+  Blob transfer test for USB HID device
+  firmware: 18F14K50/004-full-speed-hid-test
+
+  2026-10-18
+  This code is placed into PUBLIC DOMAIN
+
+  NOTE
+  - uses the full speed echo test device, see usb-hid-fullspeed-test
+  - sendblob prefixes each chunk with a sequence number, and the echo
+    device returns every chunk report as is, so byte 0 of an echo acks
+    the chunk (ack.seq = 0)
+  - out-of-order and missing acks are simulated by writing fake ack
+    reports (marked with 0xAA in byte 1) before the transfer; the
+    echoed chunks then do not match the ack mask and are discarded
+  - the retransmit case uses a timeout shorter than the echo round
+    trip, so retransmits are expected but their count varies
+
+----------------------------------------------------------------------]]
+
+local string = require "string"
+local sfmt, schar, srep = string.format, string.char, string.rep
+local mrnd = math.random
+
+local hid = require "luahidapi"
+
+local function print(...)
+  io.stdout:write(...)
+  io.stdout:write("\n")
+  io.stdout:flush()
+end
+
+------------------------------------------------------------------------
+-- initialize
+------------------------------------------------------------------------
+
+print("Blob transfer test for USB HID device:")
+print(sfmt("Lib VERSION %s build on %s", hid._VERSION, hid._TIMESTAMP))
+
+if hid.init() then
+  print("hid library: init")
+else
+  print("hid library: init error")
+  return
+end
+print()
+
+------------------------------------------------------------------------
+-- open test device
+------------------------------------------------------------------------
+
+--====================================================================--
+--** WARNING: Test uses Microchip's VID and a PID from MPLAB tools'  **
+--** PID range. DO NOT use outside of a laboratory/personal setting. **
+--====================================================================--
+
+local USB_DEVICE_VID = 0x04D8
+local USB_DEVICE_PID = 0x8AC2
+
+local USB_REPORT_SIZE = 64
+
+local dev = hid.open(USB_DEVICE_VID, USB_DEVICE_PID)
+if not dev then
+  print("Open: unable to open test device")
+  return
+end
+print("Open: opened test device")
+print()
+
+------------------------------------------------------------------------
+-- test portion
+------------------------------------------------------------------------
+
+local CHUNK = USB_REPORT_SIZE - 1       -- sequence number + payload
+local ACK_MARK = 0xAA
+local DRAIN_MSEC = 100
+
+-- discard echoes left over from a transfer
+local function drain()
+  local n = 0
+  while true do
+    local rx = dev:read(USB_REPORT_SIZE, DRAIN_MSEC)
+    if not rx or rx == "" then return n end
+    n = n + 1
+  end
+end
+
+-- queue fake acks by having the device echo them
+local function inject_acks(seqs)
+  for _, seq in ipairs(seqs) do
+    local tx = schar(seq, ACK_MARK) .. srep("\0", USB_REPORT_SIZE - 2)
+    if not dev:write(tx) then
+      print("Unable to write()")
+      print("Error: "..(dev:error() or "unknown"))
+      return false
+    end
+  end
+  return true
+end
+
+local MARKED = { seq = 0, mask = "\0\255", value = schar(0, ACK_MARK) }
+
+-- sequence numbers wrap: 600 chunks, acked by their own echoes
+local blob = {}
+for i = 1, 600 * CHUNK do blob[i] = schar(mrnd(0,255)) end
+blob = table.concat(blob)
+local bytes, retransmits = dev:sendblob(blob, { window = 16, ack = { seq = 0 } })
+if bytes ~= #blob then
+  print("Error: sequence wrap transfer failed")
+  return
+end
+print(sfmt("Wrap: %d bytes in %d chunks, %d retransmits",
+           bytes, #blob / CHUNK, retransmits))
+drain()
+
+-- out-of-order acks: chunks 0-3 are acked in reverse order
+if not inject_acks({3, 2, 1, 0}) then return end
+bytes, retransmits = dev:sendblob(srep("\0", 4 * CHUNK),
+                                  { window = 4, ack = MARKED })
+if bytes ~= 4 * CHUNK or retransmits ~= 0 then
+  print("Error: out-of-order ack transfer failed")
+  return
+end
+print(sfmt("Out of order: %d bytes, %d retransmits", bytes, retransmits))
+drain()
+
+-- retransmits: timeout shorter than the echo round trip
+bytes, retransmits = dev:sendblob(srep("\0", 64 * CHUNK),
+                                  { window = 8, timeout = 1, retries = 50,
+                                    ack = { seq = 0 } })
+if bytes ~= 64 * CHUNK then
+  print("Error: retransmit transfer failed")
+  return
+end
+print(sfmt("Retransmit: %d bytes, %d retransmits", bytes, retransmits))
+drain()
+
+-- retry exhaustion: chunk 1 is never acked
+if not inject_acks({0, 2, 3}) then return end
+local t0 = hid.clock()
+bytes = dev:sendblob(srep("\0", 4 * CHUNK),
+                     { window = 4, timeout = 50, retries = 2, ack = MARKED })
+if bytes then
+  print("Error: transfer with a missing ack succeeded")
+  return
+end
+print(sfmt("Retry exhaustion: failed after %.1f ms as expected", hid.clock() - t0))
+drain()
+print()
+
+------------------------------------------------------------------------
+-- close test device
+------------------------------------------------------------------------
+
+dev:close()
+print("Close: closed test device")
+
+------------------------------------------------------------------------
+-- close hidapi library
+------------------------------------------------------------------------
+
+if hid.exit() then
+  print("hid library: exit")
+else
+  print("hid library: exit error")
+  return
+end
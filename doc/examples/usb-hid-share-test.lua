@@ -0,0 +1,139 @@
+--[[--------------------------------------------------------------------
+
+  Shared device test for USB HID device
+  firmware: 18F14K50/004-full-speed-hid-test
+
+  2026-10-18
+  This code is placed into PUBLIC DOMAIN
+
+  NOTE
+  - uses the full speed echo test device, see usb-hid-fullspeed-test
+  - the device is shared with dev:share() and a second handle is
+    attached with hid.attach(); normally the token would be passed to
+    another Lua state (e.g. a Lua Lanes lane) of the same process, here
+    both handles live in one state to keep the test self-contained
+  - every echoed report must show up once on each handle, as each
+    handle has its own input queue
+
+----------------------------------------------------------------------]]
+
+local string = require "string"
+local sfmt, schar, srep = string.format, string.char, string.rep
+local mrnd = math.random
+
+local hid = require "luahidapi"
+
+local function print(...)
+  io.stdout:write(...)
+  io.stdout:write("\n")
+  io.stdout:flush()
+end
+
+------------------------------------------------------------------------
+-- initialize
+------------------------------------------------------------------------
+
+print("Shared device test for USB HID device:")
+print(sfmt("Lib VERSION %s build on %s", hid._VERSION, hid._TIMESTAMP))
+
+if hid.init() then
+  print("hid library: init")
+else
+  print("hid library: init error")
+  return
+end
+print()
+
+------------------------------------------------------------------------
+-- open test device
+------------------------------------------------------------------------
+
+--====================================================================--
+--** WARNING: Test uses Microchip's VID and a PID from MPLAB tools'  **
+--** PID range. DO NOT use outside of a laboratory/personal setting. **
+--====================================================================--
+
+local USB_DEVICE_VID = 0x04D8
+local USB_DEVICE_PID = 0x8AC2
+
+local USB_REPORT_SIZE = 64
+
+local dev = hid.open(USB_DEVICE_VID, USB_DEVICE_PID)
+if not dev then
+  print("Open: unable to open test device")
+  return
+end
+print("Open: opened test device")
+
+------------------------------------------------------------------------
+-- share the device and attach a second handle
+------------------------------------------------------------------------
+
+local token = dev:share(256)
+if not token then
+  print("Unable to share device")
+  return
+end
+print("Share: token "..token)
+
+local dev2 = hid.attach(token)
+if not dev2 then
+  print("Unable to attach to shared device")
+  return
+end
+print("Attach: attached second handle")
+print()
+
+------------------------------------------------------------------------
+-- test portion
+------------------------------------------------------------------------
+
+local ECHO_COUNT = 100
+local TIMEOUT_MSEC = 2000
+
+for i = 1, ECHO_COUNT do
+  -- prepare report; report 0 is implied
+  local tx = srep(schar(mrnd(0,255), mrnd(0,255), mrnd(0,255), mrnd(0,255)),
+                  USB_REPORT_SIZE / 4)
+  if not dev:write(tx) then
+    print("Unable to write()")
+    print("Error: "..(dev:error() or "unknown"))
+    return
+  end
+
+  -- both handles receive their own copy
+  for n, h in ipairs{dev, dev2} do
+    local rx = h:read(USB_REPORT_SIZE, TIMEOUT_MSEC)
+    if not rx then
+      print("Unable to read() on handle "..n)
+      return
+    elseif rx == "" then
+      print("Timeout on handle "..n..", no response from device")
+      return
+    elseif rx ~= tx then
+      print("Error: RX data on handle "..n.." is different from TX data")
+      return
+    end
+  end
+end
+print(sfmt("Echoed %d reports, each seen on both handles", ECHO_COUNT))
+print()
+
+------------------------------------------------------------------------
+-- close test device; the device closes with its last handle
+------------------------------------------------------------------------
+
+dev2:close()
+dev:close()
+print("Close: closed both handles")
+
+------------------------------------------------------------------------
+-- close hidapi library
+------------------------------------------------------------------------
+
+if hid.exit() then
+  print("hid library: exit")
+else
+  print("hid library: exit error")
+  return
+end
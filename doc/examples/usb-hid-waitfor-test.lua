@@ -0,0 +1,129 @@
+--[[--------------------------------------------------------------------
+
+  Wait for report test for USB HID device
+  firmware: 18F14K50/004-full-speed-hid-test
+
+  2026-10-18
+  This code is placed into PUBLIC DOMAIN
+
+  NOTE
+  - uses the full speed echo test device, see usb-hid-fullspeed-test
+  - waitfor reads and discards reports natively until one matches a
+    mask and value; here a numbered series of reports is echoed and
+    the wait is for one in the middle, then for one never sent
+
+----------------------------------------------------------------------]]
+
+local string = require "string"
+local sfmt, schar, srep = string.format, string.char, string.rep
+local mrnd = math.random
+
+local hid = require "luahidapi"
+
+local function print(...)
+  io.stdout:write(...)
+  io.stdout:write("\n")
+  io.stdout:flush()
+end
+
+------------------------------------------------------------------------
+-- initialize
+------------------------------------------------------------------------
+
+print("Wait for report test for USB HID device:")
+print(sfmt("Lib VERSION %s build on %s", hid._VERSION, hid._TIMESTAMP))
+
+if hid.init() then
+  print("hid library: init")
+else
+  print("hid library: init error")
+  return
+end
+print()
+
+------------------------------------------------------------------------
+-- open test device
+------------------------------------------------------------------------
+
+--====================================================================--
+--** WARNING: Test uses Microchip's VID and a PID from MPLAB tools'  **
+--** PID range. DO NOT use outside of a laboratory/personal setting. **
+--====================================================================--
+
+local USB_DEVICE_VID = 0x04D8
+local USB_DEVICE_PID = 0x8AC2
+
+local USB_REPORT_SIZE = 64
+
+local dev = hid.open(USB_DEVICE_VID, USB_DEVICE_PID)
+if not dev then
+  print("Open: unable to open test device")
+  return
+end
+print("Open: opened test device")
+print()
+
+------------------------------------------------------------------------
+-- test portion
+------------------------------------------------------------------------
+
+local ECHO_COUNT = 10
+local WANTED = 7
+local TIMEOUT_MSEC = 2000
+local MISSING_TIMEOUT_MSEC = 200
+
+local sent = {}
+for i = 1, ECHO_COUNT do
+  local tx = schar(i) .. srep(schar(mrnd(0,255)), USB_REPORT_SIZE - 1)
+  if not dev:write(tx) then
+    print("Unable to write()")
+    print("Error: "..(dev:error() or "unknown"))
+    return
+  end
+  sent[i] = tx
+end
+
+-- byte 0 of the report must equal WANTED
+local rx, time, discarded = dev:waitfor(0, "\255", schar(WANTED), TIMEOUT_MSEC)
+if rx == nil then
+  print("Unable to waitfor()")
+  return
+elseif rx == false then
+  print(sfmt("Timeout waiting for report %d, %d discarded", WANTED, time))
+  return
+elseif rx ~= sent[WANTED] or discarded ~= WANTED - 1 then
+  print("Error: wrong report or discard count")
+  return
+end
+print(sfmt("Match: report %d at %.3f ms, %d discarded", WANTED, time, discarded))
+
+-- no report matches: the rest are discarded until the timeout
+rx, discarded = dev:waitfor(0, "\255", schar(ECHO_COUNT + 1), MISSING_TIMEOUT_MSEC)
+if rx ~= false then
+  print("Error: expected a timeout")
+  return
+elseif discarded ~= ECHO_COUNT - WANTED then
+  print(sfmt("Error: %d reports discarded, expected %d",
+             discarded, ECHO_COUNT - WANTED))
+  return
+end
+print(sfmt("No match: timeout, %d discarded", discarded))
+print()
+
+------------------------------------------------------------------------
+-- close test device
+------------------------------------------------------------------------
+
+dev:close()
+print("Close: closed test device")
+
+------------------------------------------------------------------------
+-- close hidapi library
+------------------------------------------------------------------------
+
+if hid.exit() then
+  print("hid library: exit")
+else
+  print("hid library: exit error")
+  return
+end
@@ -17,6 +17,7 @@
 #include <lauxlib.h>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <wchar.h>
@@ -25,12 +26,51 @@
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define HIDAPI_HAVE_SHM
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HIDAPI_HAVE_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HIDAPI_HAVE_NEON
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #endif
 
 #ifndef TRUE
 #define TRUE 1
 #endif
 
+/* USDT tracepoints, listed with e.g. "bpftrace -l 'usdt:<module>:*'";
+ * each probe is a single nop until a tracer attaches
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define HIDAPI_PROBE2(name, a, b)               DTRACE_PROBE2(luahidapi, name, a, b)
+#define HIDAPI_PROBE3(name, a, b, c)            DTRACE_PROBE3(luahidapi, name, a, b, c)
+#define HIDAPI_PROBE4(name, a, b, c, d)         DTRACE_PROBE4(luahidapi, name, a, b, c, d)
+#define HIDAPI_PROBE5(name, a, b, c, d, e)      DTRACE_PROBE5(luahidapi, name, a, b, c, d, e)
+#else
+#define HIDAPI_PROBE2(name, a, b)               ((void)0)
+#define HIDAPI_PROBE3(name, a, b, c)            ((void)0)
+#define HIDAPI_PROBE4(name, a, b, c, d)         ((void)0)
+#define HIDAPI_PROBE5(name, a, b, c, d, e)      ((void)0)
+#endif
+
 #include "hidapi.h"
 
 #include "luahidapi.h"
@@ -42,337 +82,3412 @@
 
 #define USB_STR_MAXLEN 255      /* max USB string length */
 
+#define HID_REPORT_MAXLEN   1024    /* max input report size buffered natively */
+#define HIDCORE_MAX_HANDLES 32      /* max handles attached to a shared device */
+#define HIDCORE_POLL_MSEC   50      /* reader thread stop-check interval */
+#define HIDQUEUE_DEPTH      128     /* default per-handle input queue depth */
+#define HIDQUEUE_MAXDEPTH   65536
+#define HIDCORE_PATH_MAXLEN 255     /* device path kept for tracepoints */
+
 /*----------------------------------------------------------------------
- * definitions for HID Device object
+ * minimal portable threading, locking and atomics
+ * - Win32 uses SRW locks and condition variables (Vista or later)
+ * - atomics are sequentially consistent, which keeps the lock-free
+ *   queue and handle table below easy to reason about
  *----------------------------------------------------------------------
  */
 
-#define HIDAPI_LIB_HIDDEVICE    "HIDAPI_HIDDEVICE"
-
-typedef struct HidDevice_Obj {
-    hid_device *device;
-} HidDevice_Obj;
+#ifdef _WIN32
+typedef SRWLOCK hid_mutex_t;
+typedef CONDITION_VARIABLE hid_cond_t;
+typedef HANDLE hid_thread_t;
+#define HID_MUTEX_INITIALIZER   SRWLOCK_INIT
+#define mutex_init(m)           InitializeSRWLock(m)
+#define mutex_destroy(m)        ((void)(m))
+#define mutex_lock(m)           AcquireSRWLockExclusive(m)
+#define mutex_unlock(m)         ReleaseSRWLockExclusive(m)
+#define cond_init(c)            InitializeConditionVariable(c)
+#define cond_destroy(c)         ((void)(c))
+#define cond_signal(c)          WakeConditionVariable(c)
+#define cond_broadcast(c)       WakeAllConditionVariable(c)
+#define thread_yield()          SwitchToThread()
+#define THREAD_FUNC(name)       DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN           return 0
+typedef LPTHREAD_START_ROUTINE hid_thread_fn;
+#else
+typedef pthread_mutex_t hid_mutex_t;
+typedef pthread_cond_t hid_cond_t;
+typedef pthread_t hid_thread_t;
+#define HID_MUTEX_INITIALIZER   PTHREAD_MUTEX_INITIALIZER
+#define mutex_init(m)           pthread_mutex_init((m), NULL)
+#define mutex_destroy(m)        pthread_mutex_destroy(m)
+#define mutex_lock(m)           pthread_mutex_lock(m)
+#define mutex_unlock(m)         pthread_mutex_unlock(m)
+#define cond_init(c)            pthread_cond_init((c), NULL)
+#define cond_destroy(c)         pthread_cond_destroy(c)
+#define cond_signal(c)          pthread_cond_signal(c)
+#define cond_broadcast(c)       pthread_cond_broadcast(c)
+#define thread_yield()          sched_yield()
+#define THREAD_FUNC(name)       void *name(void *arg)
+#define THREAD_RETURN           return NULL
+typedef void *(*hid_thread_fn)(void *);
+#endif
 
-#define to_HidDevice_Obj(L) ((HidDevice_Obj*)luaL_checkudata(L, 1, HIDAPI_LIB_HIDDEVICE))
+#if defined(_MSC_VER)
+#define atomic_get(p)           InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define atomic_set(p, v)        InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define atomic_inc(p)           InterlockedIncrement((volatile LONG *)(p))
+#define atomic_dec(p)           InterlockedDecrement((volatile LONG *)(p))
+#define atomic_getptr(p)        InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define atomic_setptr(p, v)     InterlockedExchangePointer((PVOID volatile *)(p), (v))
+#define atomic_fence()          MemoryBarrier()
+#else
+#define atomic_get(p)           __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define atomic_set(p, v)        __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_inc(p)           __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define atomic_dec(p)           __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define atomic_getptr(p)        __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define atomic_setptr(p, v)     __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_fence()          __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
 
-/* validate object type and existence
+/* sleep for a number of milliseconds
  */
-static HidDevice_Obj *check_HidDevice_Obj(lua_State *L)
+static void sys_msleep(int msec)
 {
-    HidDevice_Obj *o = to_HidDevice_Obj(L);
-    if (o->device == NULL)
-        luaL_error(L, "attempt to use an invalid or closed object");
-    return o;
+#ifdef _WIN32
+    Sleep(msec);
+#else
+    usleep(msec * 1000);
+#endif
 }
 
-/*----------------------------------------------------------------------
- * hid.init()
- * Initializes hidapi library.
- * Returns true if successful, nil on failure.
- *----------------------------------------------------------------------
+/* monotonic clock in milliseconds, used for timeouts and timestamps
  */
-
-static int hidapi_init(lua_State *L)
+static double clock_msec(void)
 {
-    if (hid_init() == 0) {
-        lua_pushboolean(L, TRUE);
-    } else {
-        lua_pushnil(L);
-    }
-    return 1;
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return (double)c.QuadPart * 1000.0 / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
 }
 
-/*----------------------------------------------------------------------
- * hid.exit()
- * Cleans up and terminates hidapi library.
- * Returns true if successful, nil on failure.
- *----------------------------------------------------------------------
+/* wait on a condition variable, msec < 0 waits forever
  */
-
-static int hidapi_exit(lua_State *L)
+static void cond_wait_msec(hid_cond_t *c, hid_mutex_t *m, int msec)
 {
-    if (hid_exit() == 0) {
-        lua_pushboolean(L, TRUE);
+#ifdef _WIN32
+    SleepConditionVariableSRW(c, m, msec < 0 ? INFINITE : (DWORD)msec, 0);
+#else
+    if (msec < 0) {
+        pthread_cond_wait(c, m);
     } else {
-        lua_pushnil(L);
+        struct timeval tv;
+        struct timespec ts;
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + msec / 1000;
+        ts.tv_nsec = tv.tv_usec * 1000L + (msec % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(c, m, &ts);
     }
-    return 1;
+#endif
 }
 
-/*----------------------------------------------------------------------
- * definitions for HID Device Enumeration object
- *----------------------------------------------------------------------
+/* thread creation; returns 0 if successful, -1 on failure
  */
+static int thread_start(hid_thread_t *t, hid_thread_fn fn, void *arg)
+{
+#ifdef _WIN32
+    *t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *t == NULL ? -1 : 0;
+#else
+    return pthread_create(t, NULL, fn, arg) == 0 ? 0 : -1;
+#endif
+}
 
-#define HIDAPI_LIB_HIDENUM      "HIDAPI_HIDENUM"
-
-enum {
-    HIDENUM_CLOSE = 0,
-    HIDENUM_OPEN,
-    HIDENUM_DONE,
-    /* error state is unused, since the enumeration is done once
-     * and the returned linked list will not cause errors
-     */
-    HIDENUM_ERROR,
-};
-
-typedef struct HidEnum_Obj {
-    int state;
-    struct hid_device_info *dev_info;
-} HidEnum_Obj;
-
-#define to_HidEnum_Obj(L) ((HidEnum_Obj *)luaL_checkudata(L, 1, HIDAPI_LIB_HIDENUM))
-
-/* validate object type+existence
- */
-static HidEnum_Obj *check_HidEnum_Obj(lua_State *L)
+static void thread_join(hid_thread_t t)
 {
-    HidEnum_Obj *o = to_HidEnum_Obj(L);
-    if (o->state == HIDENUM_CLOSE)
-        luaL_error(L, "attempt to use a closed object");
-    return o;
+#ifdef _WIN32
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, NULL);
+#endif
 }
 
 /*----------------------------------------------------------------------
- * e = hid.enumerate(vid, pid)
- * e = hid.enumerate()
- * Returns a HID device enumeration object for HID devices that matches
- * given vid, pid pair. Enumerates all HID devices if no arguments
- * provided or (0,0) used.
- * IMPORTANT: Mouse and keyboard devices are not visible on Windows
- * Returns nil if failed.
+ * input report queue
+ * - single producer (the device reader thread), single consumer (the
+ *   Lua state owning the handle); push and pop are lock-free, the
+ *   mutex and condition variable are only touched when the consumer
+ *   actually has to sleep
+ * - when full, new reports are dropped and counted
  *----------------------------------------------------------------------
  */
 
-static int hidapi_enumerate(lua_State *L)
-{
-    HidEnum_Obj *o;
-    int n = lua_gettop(L);  /* number of arguments */
-    unsigned short vendor_id = 0;
-    unsigned short product_id = 0;
-
-    if (n == 2) {
-        lua_Integer id;
+typedef struct HidReport {
+    int size;
+    double time;                /* clock_msec() at arrival */
+    unsigned char data[HID_REPORT_MAXLEN];
+} HidReport;
 
-        /* validate range of vid, pid */
-        id = luaL_checkinteger(L, 1);
-        if (id < 0 || id > 0xFFFF)
-            goto error_handler;
-        vendor_id = (unsigned short)id;
+typedef struct HidQueue {
+    volatile long head;         /* next slot to write, producer side */
+    volatile long tail;         /* next slot to read, consumer side */
+    volatile long dropped;      /* reports lost to queue overflow */
+    volatile long waiting;      /* consumer is sleeping on cond */
+    unsigned long mask;         /* depth - 1, depth is a power of 2 */
+    hid_mutex_t lock;
+    hid_cond_t cond;
+    HidReport *slot;
+} HidQueue;
 
-        id = luaL_checkinteger(L, 2);
-        if (id < 0 || id > 0xFFFF)
-            goto error_handler;
-        product_id = (unsigned short)id;
+static HidQueue *queue_new(int depth)
+{
+    HidQueue *q;
+    unsigned long n = 2;
 
-    } else if (n != 0) {
-        goto error_handler;
+    while (n < (unsigned long)depth && n < HIDQUEUE_MAXDEPTH)
+        n <<= 1;
+    q = (HidQueue *)calloc(1, sizeof(HidQueue));
+    if (!q)
+        return NULL;
+    q->slot = (HidReport *)malloc(n * sizeof(HidReport));
+    if (!q->slot) {
+        free(q);
+        return NULL;
     }
+    q->mask = n - 1;
+    mutex_init(&q->lock);
+    cond_init(&q->cond);
+    return q;
+}
 
-    /* prepare object, state */
-    o = (HidEnum_Obj *)lua_newuserdata(L, sizeof(HidEnum_Obj));
-    o->state = HIDENUM_CLOSE;
-    luaL_getmetatable(L, HIDAPI_LIB_HIDENUM);
-    lua_setmetatable(L, -2);
-
-    /* set up HID device enumeration */
-    o->dev_info = hid_enumerate(vendor_id, product_id);
-    if (o->dev_info == NULL) {
-        goto error_handler;
-    }
-    o->state = HIDENUM_OPEN;
-    return 1;
+static void queue_free(HidQueue *q)
+{
+    mutex_destroy(&q->lock);
+    cond_destroy(&q->cond);
+    free(q->slot);
+    free(q);
+}
 
-error_handler:
-    lua_pushnil(L);
-    return 1;
+static int queue_empty(HidQueue *q)
+{
+    return atomic_get(&q->head) == q->tail;
 }
 
-/*----------------------------------------------------------------------
- * simple wchar_t[] to char[] conversion, returns a string
- * - exposing wchar_t[] to Lua is messy, must consider cross-platform
- *   sizes of wchar_t, so here is a quickie but crippled solution...
- *----------------------------------------------------------------------
+/* wake a sleeping consumer, if any
  */
+static void queue_wake(HidQueue *q)
+{
+    if (atomic_get(&q->waiting)) {
+        mutex_lock(&q->lock);
+        cond_broadcast(&q->cond);
+        mutex_unlock(&q->lock);
+    }
+}
 
-static void push_forced_ascii(lua_State *L, const wchar_t *s)
+/* producer side
+ */
+static void queue_push(HidQueue *q, const unsigned char *data, int size, double time)
 {
-    size_t n;
-    unsigned int i;
-    char d[USB_STR_MAXLEN + 1];
+    unsigned long h = (unsigned long)q->head;
+    unsigned long t = (unsigned long)atomic_get(&q->tail);
+    HidReport *r;
 
-    if (!s) {                   /* check for NULL case */
-        d[0] = '\0';
-        lua_pushstring(L, d);
+    if (h - t > q->mask) {
+        atomic_inc(&q->dropped);
         return;
     }
-    n = wcslen(s);
-    if (n > USB_STR_MAXLEN) n = USB_STR_MAXLEN;
+    r = &q->slot[h & q->mask];
+    memcpy(r->data, data, size);
+    r->size = size;
+    r->time = time;
+    atomic_set(&q->head, (long)(h + 1));
+    queue_wake(q);
+}
 
-    for (i = 0; i < n; i++) {
-        wchar_t wc = s[i];
-        char c = wc & 0x7F;     /* zap all de funny chars */
-        if (wc > 127 || (wc > 0 && wc < 32)) {
-            c = '?';
-        }
-        d[i] = c;
-    }
-    d[i] = '\0';
-    lua_pushstring(L, d);
+/* consumer side; caller must check queue_empty() first
+ */
+static int queue_pop(HidQueue *q, unsigned char *buf, int size, double *time)
+{
+    unsigned long t = (unsigned long)q->tail;
+    HidReport *r = &q->slot[t & q->mask];
+
+    if (size > r->size)
+        size = r->size;
+    memcpy(buf, r->data, size);
+    if (time)
+        *time = r->time;
+    atomic_set(&q->tail, (long)(t + 1));
+    return size;
 }
 
 /*----------------------------------------------------------------------
- * e:next()
- * Returns next HID device found, nil if no more.
+ * per report ID input queues (demultiplexing)
+ * - filled by the reader thread, drained by any handle of the device,
+ *   so these are plain mutex-protected rings
+ * - each has its own capacity and overflow policy, so a slow consumer
+ *   of one report ID never holds up the others
+ * - once created they live as long as the device core, removing one
+ *   only disables it
  *----------------------------------------------------------------------
  */
 
-static int hidapi_enum_next(lua_State *L)
-{
-    struct hid_device_info *dinfo;
-
-    /* validate object */
-    HidEnum_Obj *o = check_HidEnum_Obj(L);
-    if (o->state == HIDENUM_DONE) {
-        lua_pushnil(L);
-        return 1;
-    }
+enum {
+    OVERFLOW_DROP_OLDEST = 0,
+    OVERFLOW_DROP_NEWEST
+};
 
-    /* create device info table */
-    dinfo = o->dev_info;
-    lua_createtable(L, 0, 10);  /* 10 = number of fields */
+typedef struct HidIdQueue {
+    hid_mutex_t lock;
+    hid_cond_t cond;
+    volatile long enabled;
+    int overflow;
+    int capacity;
+    int head;                   /* oldest report */
+    int count;
+    unsigned long dropped;
+    HidReport *slot;
+} HidIdQueue;
 
-    lua_pushstring(L, dinfo->path);
-    lua_setfield(L, -2, "path");
-    lua_pushinteger(L, dinfo->vendor_id);
-    lua_setfield(L, -2, "vid");
-    lua_pushinteger(L, dinfo->product_id);
-    lua_setfield(L, -2, "pid");
+static HidIdQueue *idq_new(void)
+{
+    HidIdQueue *iq = (HidIdQueue *)calloc(1, sizeof(HidIdQueue));
+    if (!iq)
+        return NULL;
+    mutex_init(&iq->lock);
+    cond_init(&iq->cond);
+    return iq;
+}
 
-    push_forced_ascii(L, dinfo->serial_number);
-    lua_setfield(L, -2, "serial_number");
+static void idq_free(HidIdQueue *iq)
+{
+    mutex_destroy(&iq->lock);
+    cond_destroy(&iq->cond);
+    free(iq->slot);
+    free(iq);
+}
 
-    lua_pushinteger(L, dinfo->release_number);
-    lua_setfield(L, -2, "release");
+/* (re)configure and enable; queued reports are discarded
+ * returns 0 if successful
+ */
+static int idq_setup(HidIdQueue *iq, int capacity, int overflow)
+{
+    HidReport *slot = (HidReport *)malloc(capacity * sizeof(HidReport));
+    HidReport *old;
 
-    push_forced_ascii(L, dinfo->manufacturer_string);
-    lua_setfield(L, -2, "manufacturer_string");
-    push_forced_ascii(L, dinfo->product_string);
-    lua_setfield(L, -2, "product_string");
+    if (!slot)
+        return -1;
+    mutex_lock(&iq->lock);
+    old = iq->slot;
+    iq->slot = slot;
+    iq->capacity = capacity;
+    iq->overflow = overflow;
+    iq->head = 0;
+    iq->count = 0;
+    iq->dropped = 0;
+    atomic_set(&iq->enabled, 1);
+    mutex_unlock(&iq->lock);
+    free(old);
+    return 0;
+}
 
-    lua_pushinteger(L, dinfo->usage_page);
-    lua_setfield(L, -2, "usage_page");
-    lua_pushinteger(L, dinfo->usage);
-    lua_setfield(L, -2, "usage");
-    lua_pushinteger(L, dinfo->interface_number);
-    lua_setfield(L, -2, "interface");
+static void idq_push(HidIdQueue *iq, const unsigned char *data, int size, double time)
+{
+    HidReport *r;
 
-    /* next HID device entry */
-    o->dev_info = dinfo->next;
-    if (o->dev_info == NULL) {
-        o->state = HIDENUM_DONE;
+    mutex_lock(&iq->lock);
+    if (iq->count == iq->capacity) {
+        iq->dropped++;
+        if (iq->overflow == OVERFLOW_DROP_NEWEST) {
+            mutex_unlock(&iq->lock);
+            return;
+        }
+        iq->head = (iq->head + 1) % iq->capacity;
+        iq->count--;
     }
-    return 1;
+    r = &iq->slot[(iq->head + iq->count) % iq->capacity];
+    memcpy(r->data, data, size);
+    r->size = size;
+    r->time = time;
+    iq->count++;
+    cond_signal(&iq->cond);
+    mutex_unlock(&iq->lock);
 }
 
-/*----------------------------------------------------------------------
- * e:close()
- * Close enumeration object. Always succeeds.
- *----------------------------------------------------------------------
+/* wake all consumers, e.g. when the queue is disabled or input failed
  */
+static void idq_wake(HidIdQueue *iq)
+{
+    mutex_lock(&iq->lock);
+    cond_broadcast(&iq->cond);
+    mutex_unlock(&iq->lock);
+}
 
-static int hidapi_enum_close(lua_State *L)
+/* take the oldest report, waiting up to msec (< 0 waits forever)
+ * Returns report size, 0 on timeout, -1 if the queue is disabled or
+ * *failed becomes set.
+ */
+static int idq_pop(HidIdQueue *iq, unsigned char *buf, int size, int msec,
+                   double *time, volatile long *failed)
 {
-    HidEnum_Obj *o = check_HidEnum_Obj(L);
-    if (o->state != HIDENUM_CLOSE) {
-        hid_free_enumeration(o->dev_info);
+    double deadline = clock_msec() + msec;
+    HidReport *r;
+
+    mutex_lock(&iq->lock);
+    while (iq->count == 0) {
+        double left = deadline - clock_msec();
+        if (!atomic_get(&iq->enabled) || atomic_get(failed)) {
+            mutex_unlock(&iq->lock);
+            return -1;
+        }
+        if (msec == 0 || (msec > 0 && left <= 0)) {
+            mutex_unlock(&iq->lock);
+            return 0;
+        }
+        cond_wait_msec(&iq->cond, &iq->lock, msec < 0 ? -1 : (int)left + 1);
     }
-    o->state = HIDENUM_CLOSE;
-    return 0;
+    r = &iq->slot[iq->head];
+    if (size > r->size)
+        size = r->size;
+    memcpy(buf, r->data, size);
+    if (time)
+        *time = r->time;
+    iq->head = (iq->head + 1) % iq->capacity;
+    iq->count--;
+    mutex_unlock(&iq->lock);
+    return size;
 }
 
 /*----------------------------------------------------------------------
- * GC method for HidEnum_Obj
+ * latest-value slots
+ * - the reader thread overwrites the slot of a report ID with each new
+ *   report under a sequence lock: the sequence is odd while the slot
+ *   is being written, readers retry if it was odd or changed while they
+ *   copied, so readers never block the producer
  *----------------------------------------------------------------------
  */
 
-static int hidapi_enum_meta_gc(lua_State *L)
+#define LATEST_ANY 256          /* slot holding the newest of any ID */
+
+typedef struct HidLatest {
+    volatile long seq;
+    int size;
+    double time;
+    unsigned char data[HID_REPORT_MAXLEN];
+} HidLatest;
+
+/* producer side
+ */
+static void latest_store(HidLatest *l, const unsigned char *data, int size, double time)
 {
-    HidEnum_Obj *o = to_HidEnum_Obj(L);
-    if (o->state != HIDENUM_CLOSE) {
+    long seq = l->seq;
+    atomic_set(&l->seq, seq + 1);
+    atomic_fence();
+    memcpy(l->data, data, size);
+    l->size = size;
+    l->time = time;
+    atomic_fence();
+    atomic_set(&l->seq, seq + 2);
+}
+
+/* consumer side; returns the number of updates so far, 0 if none
+ */
+static long latest_load(HidLatest *l, unsigned char *buf, int *size, double *time)
+{
+    long s1, s2;
+    do {
+        s1 = atomic_get(&l->seq);
+        while (s1 & 1) {
+            thread_yield();
+            s1 = atomic_get(&l->seq);
+        }
+        atomic_fence();
+        *size = l->size;
+        if (*size > HID_REPORT_MAXLEN)  /* torn read, retried below */
+            *size = HID_REPORT_MAXLEN;
+        memcpy(buf, l->data, *size);
+        *time = l->time;
+        atomic_fence();
+        s2 = atomic_get(&l->seq);
+    } while (s1 != s2);
+    return s1 / 2;
+}
+
+/*----------------------------------------------------------------------
+ * shared memory report ring, for fan-out to other processes
+ * - one publishing process writes, any number of subscribers read;
+ *   report n goes to slot n % capacity under a per-slot sequence lock
+ *   (2n+1 while writing, 2n+2 once complete), so subscribers detect
+ *   both not-yet-written and overwritten slots without locking
+ * - on Linux, subscribers sleep on a futex bumped by the publisher;
+ *   elsewhere they poll
+ *----------------------------------------------------------------------
+ */
+
+#ifdef HIDAPI_HAVE_SHM
+
+#define HIDSHM_MAGIC        0x50444948UL    /* "HIDP" */
+#define HIDSHM_VERSION      1
+#define HIDSHM_NAME_MAXLEN  250
+#define HIDSHM_POLL_USEC    500             /* poll interval without futex */
+
+typedef struct HidShmHeader {
+    volatile uint32_t magic;    /* written last by the publisher */
+    uint32_t version;
+    uint32_t capacity;          /* number of slots, a power of 2 */
+    uint32_t slot_size;         /* report bytes per slot */
+    uint32_t stride;            /* bytes between slots */
+    volatile uint32_t wake;     /* futex word, bumped per report */
+    volatile uint32_t waiters;  /* subscribers sleeping on wake */
+    uint32_t reserved;
+    volatile uint64_t head;     /* number of reports published */
+} HidShmHeader;
+
+typedef struct HidShmSlot {
+    volatile uint64_t seq;
+    double time;
+    uint32_t size;
+    uint32_t reserved;
+    unsigned char data[8];      /* slot_size bytes, really */
+} HidShmSlot;
+
+typedef struct HidShm {
+    HidShmHeader *hdr;
+    size_t mapsize;
+    char name[HIDSHM_NAME_MAXLEN + 2];
+} HidShm;
+
+/* slot n of the ring at h, with the geometry taken from header l */
+#define shm_slot_in(h, l, n) \
+    ((HidShmSlot *)((unsigned char *)((h) + 1) + \
+                    (size_t)((n) & ((l)->capacity - 1)) * (l)->stride))
+#define shm_slot(h, n)  shm_slot_in(h, h, n)
+
+static void shm_name(char *d, const char *name)
+{
+    d[0] = '/';
+    strncpy(d + 1, name[0] == '/' ? name + 1 : name, HIDSHM_NAME_MAXLEN);
+    d[HIDSHM_NAME_MAXLEN + 1] = '\0';
+}
+
+static void shm_wake(HidShmHeader *h)
+{
+    atomic_inc(&h->wake);
+#ifdef __linux__
+    if (atomic_get(&h->waiters))
+        syscall(SYS_futex, &h->wake, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* sleep until the wake word moves away from val, or msec passes
+ */
+static void shm_sleep(HidShmHeader *h, uint32_t val, int msec)
+{
+#ifdef __linux__
+    struct timespec ts, *tsp = NULL;
+    if (msec >= 0) {
+        ts.tv_sec = msec / 1000;
+        ts.tv_nsec = (msec % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    atomic_inc(&h->waiters);
+    syscall(SYS_futex, &h->wake, FUTEX_WAIT, val, tsp, NULL, 0);
+    atomic_dec(&h->waiters);
+#else
+    (void)val;
+    usleep(msec >= 0 && msec * 1000 < HIDSHM_POLL_USEC ? msec * 1000 : HIDSHM_POLL_USEC);
+#endif
+}
+
+/* create and map a ring; returns NULL on failure, including when an
+ * object of that name already exists, as it may be another publisher's
+ * live ring
+ */
+static HidShm *shm_create(const char *name, int capacity, int slot_size)
+{
+    HidShm *m;
+    HidShmHeader *h;
+    uint32_t n = 2;
+    uint32_t stride;
+    size_t mapsize;
+    uint64_t i;
+    int fd;
+
+    while (n < (uint32_t)capacity && n < HIDQUEUE_MAXDEPTH)
+        n <<= 1;
+    stride = (uint32_t)((offsetof(HidShmSlot, data) + slot_size + 7) & ~(size_t)7);
+    mapsize = sizeof(HidShmHeader) + (size_t)n * stride;
+
+    m = (HidShm *)calloc(1, sizeof(HidShm));
+    if (!m)
+        return NULL;
+    shm_name(m->name, name);
+    fd = shm_open(m->name, O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd < 0)
+        goto error_handler;
+    if (ftruncate(fd, mapsize) < 0) {
+        close(fd);
+        shm_unlink(m->name);
+        goto error_handler;
+    }
+    h = (HidShmHeader *)mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        shm_unlink(m->name);
+        goto error_handler;
+    }
+
+    h->version = HIDSHM_VERSION;
+    h->capacity = n;
+    h->slot_size = slot_size;
+    h->stride = stride;
+    for (i = 0; i < n; i++)
+        shm_slot(h, i)->seq = 0;
+    atomic_fence();
+    atomic_set(&h->magic, HIDSHM_MAGIC);
+    m->hdr = h;
+    m->mapsize = mapsize;
+    return m;
+
+error_handler:
+    free(m);
+    return NULL;
+}
+
+static void shm_destroy(HidShm *m)
+{
+    munmap(m->hdr, m->mapsize);
+    shm_unlink(m->name);
+    free(m);
+}
+
+/* publisher side
+ */
+static void shm_publish(HidShm *m, const unsigned char *data, int size, double time)
+{
+    HidShmHeader *h = m->hdr;
+    uint64_t n = h->head;
+    HidShmSlot *sl = shm_slot(h, n);
+
+    if (size > (int)h->slot_size)
+        size = h->slot_size;
+    atomic_set(&sl->seq, 2 * n + 1);
+    atomic_fence();
+    memcpy(sl->data, data, size);
+    sl->size = size;
+    sl->time = time;
+    atomic_fence();
+    atomic_set(&sl->seq, 2 * n + 2);
+    atomic_set(&h->head, n + 1);
+    shm_wake(h);
+}
+
+#endif /* HIDAPI_HAVE_SHM */
+
+/*----------------------------------------------------------------------
+ * native device core
+ * - one per opened hid_device, reference counted by the handles (in any
+ *   Lua state) attached to it
+ * - hidapi calls other than reads are serialized by the core lock
+ * - once a reader thread is started, it owns all input: every report is
+ *   copied into each attached handle's queue (fan-out); the handle table
+ *   is scanned without locking, detaching waits for the routing pass in
+ *   progress (if any) to finish before the queue is freed
+ * - in latest mode, each report also updates the latest-value slots of
+ *   its report ID (first byte) and of LATEST_ANY
+ * - reports whose first byte (report ID) has an enabled ID queue go
+ *   to that queue instead of the handles
+ * - all reports are also copied to the shared memory ring, if published
+ * - shared cores are listed under a numeric token for hid.attach()
+ * - output reports may be coalesced: the last write per report ID is
+ *   kept and flushed periodically by a writer thread
+ *----------------------------------------------------------------------
+ */
+
+typedef struct HidPending {
+    int size;                   /* 0 if nothing pending */
+    unsigned char data[HID_REPORT_MAXLEN + 1];
+} HidPending;
+
+typedef struct HidCore {
+    hid_device *device;
+    long refcount;              /* protected by share_lock */
+    long token;                 /* share token, 0 if not shared */
+    int depth;                  /* queue depth for attached handles */
+    hid_mutex_t lock;           /* serializes hidapi calls except reads */
+    hid_thread_t reader;
+    volatile long running;      /* reader thread started */
+    volatile long stop;         /* asks the reader thread to quit */
+    volatile long failed;       /* reader thread hit a read error */
+    volatile long routing;      /* odd while a report is being routed */
+    HidQueue *volatile queue[HIDCORE_MAX_HANDLES];
+    HidIdQueue *volatile idq[256];      /* created under lock */
+    volatile long latest_on;            /* handles in latest mode */
+    HidLatest *volatile latest[LATEST_ANY + 1]; /* created by reader */
+#ifdef HIDAPI_HAVE_SHM
+    struct HidShm *volatile shm;        /* published ring, under lock */
+#endif
+    hid_mutex_t wjoin;          /* serializes coalescing start and stop */
+    hid_mutex_t wlock;          /* protects the coalescing state below */
+    hid_cond_t wcond;
+    struct HidWriter *writer;   /* current writer thread, if any */
+    int coalescing;             /* writes are being coalesced */
+    int interval;               /* flush interval in msec */
+    unsigned long merged;       /* writes overwritten before a flush */
+    unsigned long flushed;      /* writes sent by the writer thread */
+    unsigned long wfailed;      /* failed writes by the writer thread */
+    HidPending *pending[256];
+    uint32_t pendmask[8];       /* report IDs with a pending report */
+    struct HidCore *next;       /* list of shared cores */
+    char path[HIDCORE_PATH_MAXLEN + 1]; /* path or "vid:pid" as opened */
+} HidCore;
+
+static hid_mutex_t share_lock = HID_MUTEX_INITIALIZER;
+static HidCore *share_list = NULL;
+static long share_token = 0;
+
+static HidCore *core_new(hid_device *dev)
+{
+    HidCore *c = (HidCore *)calloc(1, sizeof(HidCore));
+    if (!c)
+        return NULL;
+    c->device = dev;
+    c->refcount = 1;
+    c->depth = HIDQUEUE_DEPTH;
+    mutex_init(&c->lock);
+    mutex_init(&c->wjoin);
+    mutex_init(&c->wlock);
+    cond_init(&c->wcond);
+    return c;
+}
+
+/* deliver a report to every attached handle
+ */
+static void core_route(HidCore *c, const unsigned char *data, int size, double time)
+{
+    HidIdQueue *iq = (HidIdQueue *)atomic_getptr(&c->idq[data[0]]);
+    int i;
+
+    atomic_inc(&c->routing);
+#ifdef HIDAPI_HAVE_SHM
+    {
+        HidShm *m = (HidShm *)atomic_getptr(&c->shm);
+        if (m)
+            shm_publish(m, data, size, time);
+    }
+#endif
+    if (atomic_get(&c->latest_on)) {
+        int slot[2];
+        slot[0] = data[0];
+        slot[1] = LATEST_ANY;
+        for (i = 0; i < 2; i++) {
+            HidLatest *l = c->latest[slot[i]];
+            if (!l) {
+                l = (HidLatest *)calloc(1, sizeof(HidLatest));
+                if (!l)
+                    continue;
+                atomic_setptr(&c->latest[slot[i]], l);
+            }
+            latest_store(l, data, size, time);
+        }
+    }
+    if (iq && atomic_get(&iq->enabled)) {
+        idq_push(iq, data, size, time);
+    } else {
+        for (i = 0; i < HIDCORE_MAX_HANDLES; i++) {
+            HidQueue *q = (HidQueue *)atomic_getptr(&c->queue[i]);
+            if (q)
+                queue_push(q, data, size, time);
+        }
+    }
+    atomic_inc(&c->routing);
+}
+
+static THREAD_FUNC(core_reader)
+{
+    HidCore *c = (HidCore *)arg;
+    unsigned char buf[HID_REPORT_MAXLEN];
+    int i;
+
+    while (!atomic_get(&c->stop)) {
+        int res = hid_read_timeout(c->device, buf, sizeof(buf), HIDCORE_POLL_MSEC);
+        if (res < 0) {
+            atomic_set(&c->failed, 1);
+            break;
+        }
+        if (res > 0)
+            core_route(c, buf, res, clock_msec());
+    }
+    /* let blocked readers see the failure */
+    for (i = 0; i < HIDCORE_MAX_HANDLES; i++) {
+        HidQueue *q = (HidQueue *)atomic_getptr(&c->queue[i]);
+        if (q)
+            queue_wake(q);
+    }
+    for (i = 0; i < 256; i++) {
+        HidIdQueue *iq = (HidIdQueue *)atomic_getptr(&c->idq[i]);
+        if (iq)
+            idq_wake(iq);
+    }
+    THREAD_RETURN;
+}
+
+/* start the reader thread if it is not running; returns 0 if successful,
+ * -1 on failure
+ */
+static int core_start(HidCore *c)
+{
+    int res = 0;
+    mutex_lock(&c->lock);
+    if (!c->running) {
+        res = thread_start(&c->reader, core_reader, c);
+        if (res == 0)
+            atomic_set(&c->running, 1);
+    }
+    mutex_unlock(&c->lock);
+    return res;
+}
+
+/* add a queue to the handle table; returns 0 if successful
+ */
+static int core_attach(HidCore *c, HidQueue *q)
+{
+    int i;
+    mutex_lock(&c->lock);
+    for (i = 0; i < HIDCORE_MAX_HANDLES; i++) {
+        if (c->queue[i] == NULL) {
+            atomic_setptr(&c->queue[i], q);
+            break;
+        }
+    }
+    mutex_unlock(&c->lock);
+    return i < HIDCORE_MAX_HANDLES ? 0 : -1;
+}
+
+/* wait for the routing pass in progress, if any; anything unhooked
+ * from the core before this call is no longer in use afterwards
+ */
+static void core_sync(HidCore *c)
+{
+    long r = atomic_get(&c->routing);
+    if (r & 1) {
+        while (atomic_get(&c->routing) == r)
+            thread_yield();
+    }
+}
+
+/* remove a queue from the handle table; the queue may be freed after
+ * this returns
+ */
+static void core_detach(HidCore *c, HidQueue *q)
+{
+    int i;
+
+    mutex_lock(&c->lock);
+    for (i = 0; i < HIDCORE_MAX_HANDLES; i++) {
+        if (c->queue[i] == q)
+            atomic_setptr(&c->queue[i], NULL);
+    }
+    mutex_unlock(&c->lock);
+    core_sync(c);
+}
+
+static void coalesce_stop(HidCore *c);
+
+/* drop a reference; the last one stops the reader and closes the device
+ */
+static void core_release(HidCore *c)
+{
+    long refs;
+    int i;
+
+    mutex_lock(&share_lock);
+    refs = --c->refcount;
+    if (refs == 0 && c->token) {
+        HidCore **p = &share_list;
+        while (*p != c)
+            p = &(*p)->next;
+        *p = c->next;
+    }
+    mutex_unlock(&share_lock);
+    if (refs > 0)
+        return;
+
+    coalesce_stop(c);
+    if (c->running) {
+        atomic_set(&c->stop, 1);
+        thread_join(c->reader);
+    }
+    for (i = 0; i < 256; i++) {
+        if (c->idq[i])
+            idq_free(c->idq[i]);
+        free(c->pending[i]);
+    }
+    for (i = 0; i <= LATEST_ANY; i++)
+        free(c->latest[i]);
+#ifdef HIDAPI_HAVE_SHM
+    if (c->shm)
+        shm_destroy(c->shm);
+#endif
+    hid_close(c->device);
+    mutex_destroy(&c->lock);
+    mutex_destroy(&c->wjoin);
+    mutex_destroy(&c->wlock);
+    cond_destroy(&c->wcond);
+    free(c);
+}
+
+/* get the queue for a report ID, creating it (disabled) if needed
+ */
+static HidIdQueue *core_idq(HidCore *c, int id)
+{
+    HidIdQueue *iq;
+    mutex_lock(&c->lock);
+    iq = c->idq[id];
+    if (!iq) {
+        iq = idq_new();
+        if (iq)
+            atomic_setptr(&c->idq[id], iq);
+    }
+    mutex_unlock(&c->lock);
+    return iq;
+}
+
+/*----------------------------------------------------------------------
+ * output report coalescing
+ * - while enabled, writes only replace the pending report of their
+ *   report ID (last write wins); the writer thread sends pending
+ *   reports every interval, and once more when stopped
+ * - start and stop are serialized, and each writer thread has its own
+ *   stop flag, so a restart never revives a writer being joined
+ *----------------------------------------------------------------------
+ */
+
+typedef struct HidWriter {
+    HidCore *core;
+    hid_thread_t thread;
+    int stop;                   /* under core wlock */
+} HidWriter;
+
+/* send all pending reports; called by the writer thread
+ */
+static void coalesce_flush(HidCore *c)
+{
+    unsigned char buf[HID_REPORT_MAXLEN + 1];
+    uint32_t mask[8];
+    int i;
+
+    /* take the set of pending report IDs; nothing to do when idle */
+    mutex_lock(&c->wlock);
+    memcpy(mask, c->pendmask, sizeof(mask));
+    memset(c->pendmask, 0, sizeof(c->pendmask));
+    mutex_unlock(&c->wlock);
+
+    for (i = 0; i < 256; i++) {
+        uint32_t word = mask[i >> 5] >> (i & 31);
+        int size = 0;
+        if (word == 0) {
+            i |= 31;            /* none left in this word */
+            continue;
+        }
+        if (!(word & 1))
+            continue;
+        mutex_lock(&c->wlock);
+        if (c->pending[i] && c->pending[i]->size > 0) {
+            size = c->pending[i]->size;
+            memcpy(buf, c->pending[i]->data, size);
+            c->pending[i]->size = 0;
+        }
+        mutex_unlock(&c->wlock);
+        if (size > 0) {
+            int res;
+            mutex_lock(&c->lock);
+            res = hid_write(c->device, buf, size);
+            mutex_unlock(&c->lock);
+            mutex_lock(&c->wlock);
+            if (res < 0)
+                c->wfailed++;
+            else
+                c->flushed++;
+            mutex_unlock(&c->wlock);
+        }
+    }
+}
+
+static THREAD_FUNC(core_writer)
+{
+    HidWriter *w = (HidWriter *)arg;
+    HidCore *c = w->core;
+    double next = clock_msec();
+
+    mutex_lock(&c->wlock);
+    while (!w->stop) {
+        double left;
+        next += c->interval;
+        left = next - clock_msec();
+        if (left < 0)           /* fell behind, do not burst */
+            next = clock_msec();
+        else
+            cond_wait_msec(&c->wcond, &c->wlock, (int)left);
+        mutex_unlock(&c->wlock);
+        coalesce_flush(c);
+        mutex_lock(&c->wlock);
+    }
+    mutex_unlock(&c->wlock);
+    coalesce_flush(c);
+    THREAD_RETURN;
+}
+
+/* start coalescing, or change the interval; returns 0 if successful, -1
+ * on failure
+ */
+static int coalesce_start(HidCore *c, int interval)
+{
+    HidWriter *w;
+    int res = 0;
+
+    mutex_lock(&c->wjoin);
+    mutex_lock(&c->wlock);
+    c->interval = interval;
+    mutex_unlock(&c->wlock);
+    if (!c->writer) {
+        w = (HidWriter *)calloc(1, sizeof(HidWriter));
+        if (!w) {
+            mutex_unlock(&c->wjoin);
+            return -1;
+        }
+        w->core = c;
+        res = thread_start(&w->thread, core_writer, w);
+        if (res == 0) {
+            c->writer = w;
+            mutex_lock(&c->wlock);
+            c->coalescing = 1;
+            mutex_unlock(&c->wlock);
+        } else {
+            free(w);
+        }
+    }
+    mutex_unlock(&c->wjoin);
+    return res;
+}
+
+/* stop coalescing; pending reports are sent before this returns
+ */
+static void coalesce_stop(HidCore *c)
+{
+    HidWriter *w;
+
+    mutex_lock(&c->wjoin);
+    w = c->writer;
+    c->writer = NULL;
+    mutex_lock(&c->wlock);
+    c->coalescing = 0;
+    if (w)
+        w->stop = 1;
+    cond_broadcast(&c->wcond);
+    mutex_unlock(&c->wlock);
+    if (w) {
+        thread_join(w->thread);
+        free(w);
+    }
+    mutex_unlock(&c->wjoin);
+}
+
+/* make a report pending; returns 0 if coalesced, -1 if the caller has
+ * to write it itself
+ */
+static int coalesce_put(HidCore *c, const unsigned char *data, int size)
+{
+    HidPending *p;
+
+    if (size < 1 || size > HID_REPORT_MAXLEN + 1)
+        return -1;
+    mutex_lock(&c->wlock);
+    if (!c->coalescing) {
+        mutex_unlock(&c->wlock);
+        return -1;
+    }
+    p = c->pending[data[0]];
+    if (!p) {
+        p = (HidPending *)calloc(1, sizeof(HidPending));
+        if (!p) {
+            mutex_unlock(&c->wlock);
+            return -1;
+        }
+        c->pending[data[0]] = p;
+    }
+    if (p->size > 0)
+        c->merged++;
+    memcpy(p->data, data, size);
+    p->size = size;
+    c->pendmask[data[0] >> 5] |= (uint32_t)1 << (data[0] & 31);
+    mutex_unlock(&c->wlock);
+    return 0;
+}
+
+/*----------------------------------------------------------------------
+ * input report change filter
+ * - remembers the last report per report ID and drops a new report if
+ *   no masked bit differs from it
+ * - the report ID is byte 0 for devices with numbered reports, all
+ *   reports share one slot otherwise
+ *----------------------------------------------------------------------
+ */
+
+enum {
+    FILTER_NONE = 0,
+    FILTER_CHANGED
+};
+
+typedef struct HidFilter {
+    int mode;
+    int numbered;               /* byte 0 is a report ID */
+    unsigned long passed;
+    unsigned long suppressed;
+    int lastsize[256];          /* size of last report, 0 if none */
+    unsigned char *last[256];   /* last report per report ID */
+    unsigned char mask[HID_REPORT_MAXLEN];
+} HidFilter;
+
+static void filter_free(HidFilter *f)
+{
+    int i;
+    for (i = 0; i < 256; i++)
+        free(f->last[i]);
+    free(f);
+}
+
+/* compare one 64-byte block (a full speed report) under a mask; SIMD
+ * where the target has it, else eight unrolled 64-bit words
+ */
+static int masked_differs64(const unsigned char *a, const unsigned char *b,
+                            const unsigned char *m)
+{
+#if defined(HIDAPI_HAVE_SSE2)
+    __m128i acc = _mm_setzero_si128();
+    int i;
+    for (i = 0; i < 64; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i vm = _mm_loadu_si128((const __m128i *)(m + i));
+        acc = _mm_or_si128(acc, _mm_and_si128(_mm_xor_si128(va, vb), vm));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF;
+#elif defined(HIDAPI_HAVE_NEON)
+    uint8x16_t acc = vdupq_n_u8(0);
+    uint64x2_t w;
+    int i;
+    for (i = 0; i < 64; i += 16)
+        acc = vorrq_u8(acc, vandq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)),
+                                     vld1q_u8(m + i)));
+    w = vreinterpretq_u64_u8(acc);
+    return (vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1)) != 0;
+#else
+    uint64_t wa[8], wb[8], wm[8];
+    memcpy(wa, a, 64);
+    memcpy(wb, b, 64);
+    memcpy(wm, m, 64);
+    return (((wa[0] ^ wb[0]) & wm[0]) | ((wa[1] ^ wb[1]) & wm[1]) |
+            ((wa[2] ^ wb[2]) & wm[2]) | ((wa[3] ^ wb[3]) & wm[3]) |
+            ((wa[4] ^ wb[4]) & wm[4]) | ((wa[5] ^ wb[5]) & wm[5]) |
+            ((wa[6] ^ wb[6]) & wm[6]) | ((wa[7] ^ wb[7]) & wm[7])) != 0;
+#endif
+}
+
+/* nonzero if any masked bit of a and b differs; 64-byte blocks go
+ * through masked_differs64(), the rest by 64-bit words and bytes
+ */
+static int masked_differs(const unsigned char *a, const unsigned char *b,
+                          const unsigned char *m, int n)
+{
+    uint64_t diff = 0;
+    int i = 0;
+
+    for (; i + 64 <= n; i += 64) {
+        if (masked_differs64(a + i, b + i, m + i))
+            return 1;
+    }
+    for (; i + 8 <= n; i += 8) {
+        uint64_t wa, wb, wm;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        memcpy(&wm, m + i, 8);
+        diff |= (wa ^ wb) & wm;
+    }
+    for (; i < n; i++)
+        diff |= (a[i] ^ b[i]) & m[i];
+    return diff != 0;
+}
+
+/* returns nonzero if the report should be delivered
+ */
+static int filter_pass(HidFilter *f, const unsigned char *data, int size)
+{
+    int id = (f->numbered && size > 0) ? data[0] : 0;
+
+    if (f->mode == FILTER_NONE || size <= 0)
+        return 1;
+    if (size > HID_REPORT_MAXLEN)
+        size = HID_REPORT_MAXLEN;
+    if (f->lastsize[id] == size &&
+        !masked_differs(f->last[id], data, f->mask, size)) {
+        f->suppressed++;
+        return 0;
+    }
+    if (!f->last[id]) {
+        f->last[id] = (unsigned char *)malloc(HID_REPORT_MAXLEN);
+        if (!f->last[id]) {     /* deliver unfiltered */
+            f->passed++;
+            return 1;
+        }
+    }
+    memcpy(f->last[id], data, size);
+    f->lastsize[id] = size;
+    f->passed++;
+    return 1;
+}
+
+/* nonzero if a report has the given report ID (0 matches any report)
+ * and (report & mask) == (value & mask) over the length of the mask;
+ * missing value bytes count as zero
+ */
+static int report_matches(const unsigned char *r, int size, int id,
+                          const unsigned char *mask, int masklen,
+                          const unsigned char *value, int valuelen)
+{
+    int i;
+
+    if (id > 0 && (size < 1 || r[0] != id))
+        return 0;
+    if (size < masklen)
+        return 0;
+    for (i = 0; i < masklen; i++) {
+        unsigned char v = i < valuelen ? value[i] : 0;
+        if ((r[i] ^ v) & mask[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * report field layouts
+ * - a field is a fixed-width integer or float at a byte offset in the
+ *   report as returned by read (offset 0 is the first byte, which is
+ *   the report ID for numbered reports)
+ *----------------------------------------------------------------------
+ */
+
+#define FIELD_NAME_MAXLEN 31
+
+enum {
+    FIELD_U8 = 0, FIELD_S8,
+    FIELD_U16, FIELD_S16, FIELD_U16BE, FIELD_S16BE,
+    FIELD_U32, FIELD_S32, FIELD_U32BE, FIELD_S32BE,
+    FIELD_F32
+};
+
+static const char *const field_types[] = {
+    "u8", "s8",
+    "u16", "s16", "u16be", "s16be",
+    "u32", "s32", "u32be", "s32be",
+    "f32", NULL
+};
+
+static const int field_width[] = {
+    1, 1,
+    2, 2, 2, 2,
+    4, 4, 4, 4,
+    4
+};
+
+typedef struct HidField {
+    int offset;
+    int type;
+    char name[FIELD_NAME_MAXLEN + 1];   /* empty if unnamed */
+} HidField;
+
+/* decode a field; the caller checks that it lies within the report
+ */
+static double field_value(const HidField *f, const unsigned char *r)
+{
+    const unsigned char *p = r + f->offset;
+    uint32_t u;
+    float v;
+
+    switch (f->type) {
+    case FIELD_U8:      return p[0];
+    case FIELD_S8:      return (int8_t)p[0];
+    case FIELD_U16:     return (uint16_t)(p[0] | (p[1] << 8));
+    case FIELD_S16:     return (int16_t)(p[0] | (p[1] << 8));
+    case FIELD_U16BE:   return (uint16_t)((p[0] << 8) | p[1]);
+    case FIELD_S16BE:   return (int16_t)((p[0] << 8) | p[1]);
+    case FIELD_U32:
+    case FIELD_S32:
+    case FIELD_F32:
+        u = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+            ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        break;
+    default:            /* big endian 32-bit */
+        u = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+            ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+        break;
+    }
+    if (f->type == FIELD_F32) {
+        memcpy(&v, &u, sizeof(v));
+        return v;
+    }
+    if (f->type == FIELD_S32 || f->type == FIELD_S32BE)
+        return (int32_t)u;
+    return u;
+}
+
+/*----------------------------------------------------------------------
+ * windowed aggregation of report fields
+ *----------------------------------------------------------------------
+ */
+
+typedef struct HidAggStat {
+    unsigned long count;
+    double min;
+    double max;
+    double sum;
+} HidAggStat;
+
+typedef struct HidAgg {
+    int nfields;
+    int size;                   /* report buffer size */
+    int id;                     /* report ID to aggregate, -1 for all */
+    double window;              /* window length in msec */
+    double start;               /* start of the current window */
+    unsigned long count;        /* reports in the current window */
+    HidField *field;
+    HidAggStat *stat;
+    int heldsize;               /* report read past the window end, */
+    double heldtime;            /* kept for the next window */
+    unsigned char held[HID_REPORT_MAXLEN];
+} HidAgg;
+
+static HidAgg *agg_new(int nfields)
+{
+    HidAgg *a = (HidAgg *)calloc(1, sizeof(HidAgg) +
+                                 nfields * (sizeof(HidField) + sizeof(HidAggStat)));
+    if (!a)
+        return NULL;
+    a->nfields = nfields;
+    a->stat = (HidAggStat *)(a + 1);
+    a->field = (HidField *)(a->stat + nfields);
+    return a;
+}
+
+static void agg_reset(HidAgg *a, double start)
+{
+    a->start = start;
+    a->count = 0;
+    memset(a->stat, 0, a->nfields * sizeof(HidAggStat));
+}
+
+static void agg_add(HidAgg *a, const unsigned char *data, int size)
+{
+    int i;
+
+    if (a->id >= 0 && (size < 1 || data[0] != a->id))
+        return;
+    a->count++;
+    for (i = 0; i < a->nfields; i++) {
+        const HidField *f = &a->field[i];
+        HidAggStat *st = &a->stat[i];
+        double v;
+        if (f->offset + field_width[f->type] > size)
+            continue;
+        v = field_value(f, data);
+        if (st->count == 0 || v < st->min)
+            st->min = v;
+        if (st->count == 0 || v > st->max)
+            st->max = v;
+        st->sum += v;
+        st->count++;
+    }
+}
+
+/*----------------------------------------------------------------------
+ * definitions for HID Device object
+ * - a handle in one Lua state; several handles (from different Lua
+ *   states) may refer to the same shared core
+ *----------------------------------------------------------------------
+ */
+
+#define HIDAPI_LIB_HIDDEVICE    "HIDAPI_HIDDEVICE"
+
+typedef struct HidDevice_Obj {
+    hid_device *device;         /* NULL once closed */
+    HidCore *core;
+    HidQueue *queue;            /* input queue, once a reader runs */
+    HidFilter *filter;          /* optional input filter */
+    HidAgg *agg;                /* optional aggregation stage */
+    int nonblock;
+    int latest;                 /* counted in core->latest_on */
+} HidDevice_Obj;
+
+#define to_HidDevice_Obj(L) ((HidDevice_Obj*)luaL_checkudata(L, 1, HIDAPI_LIB_HIDDEVICE))
+
+/* validate object type and existence
+ */
+static HidDevice_Obj *check_HidDevice_Obj(lua_State *L)
+{
+    HidDevice_Obj *o = to_HidDevice_Obj(L);
+    if (o->device == NULL)
+        luaL_error(L, "attempt to use an invalid or closed object");
+    return o;
+}
+
+/* hidapi calls other than reads go through the core lock, as another
+ * Lua state may be using the same device concurrently
+ */
+#define dev_lock(o)     mutex_lock(&(o)->core->lock)
+#define dev_unlock(o)   mutex_unlock(&(o)->core->lock)
+
+/* device path for tracepoints; a pointer, as probe arguments are
+ * passed by value
+ */
+#define dev_path(o)     ((const char *)(o)->core->path)
+
+/* detach a handle from its core; closes the device with the last handle
+ */
+static void dev_detach(HidDevice_Obj *o)
+{
+    if (o->queue) {
+        core_detach(o->core, o->queue);
+        queue_free(o->queue);
+    }
+    if (o->latest) {
+        atomic_dec(&o->core->latest_on);
+    }
+    if (o->core) {
+        core_release(o->core);
+    }
+    if (o->filter) {
+        filter_free(o->filter);
+    }
+    free(o->agg);
+    o->queue = NULL;
+    o->filter = NULL;
+    o->agg = NULL;
+    o->latest = 0;
+    o->core = NULL;
+    o->device = NULL;
+}
+
+/* hand input over to the reader thread, giving this handle a queue;
+ * returns 0 if successful
+ */
+static int dev_start_reader(HidDevice_Obj *o)
+{
+    if (!o->queue) {
+        HidQueue *q = queue_new(o->core->depth);
+        if (!q)
+            return -1;
+        if (core_attach(o->core, q) < 0) {
+            queue_free(q);
+            return -1;
+        }
+        o->queue = q;
+    }
+    return core_start(o->core);
+}
+
+/* read one input report, directly or from the handle's queue once the
+ * reader thread owns the device; if id names an enabled report ID
+ * queue, the report comes from there
+ * msec < 0 blocks, msec == 0 polls
+ * Returns report size, 0 if nothing arrived in time, -1 on error.
+ */
+static int dev_read_raw(HidDevice_Obj *o, int id, unsigned char *buf, int size,
+                        int msec, double *time)
+{
+    HidQueue *q = o->queue;
+    double deadline;
+    int ready;
+
+    if (id > 0 && id <= 0xFF) {
+        HidIdQueue *iq = (HidIdQueue *)atomic_getptr(&o->core->idq[id]);
+        if (iq && atomic_get(&iq->enabled))
+            return idq_pop(iq, buf, size, msec, time, &o->core->failed);
+    }
+
+    if (!q) {
+        int res;
+        if (atomic_get(&o->core->running))
+            return -1;          /* handle in latest mode */
+        res = hid_read_timeout(o->device, buf, size, msec);
+        if (time)
+            *time = clock_msec();
+        return res;
+    }
+
+    if (!queue_empty(q))
+        return queue_pop(q, buf, size, time);
+    if (msec == 0 || atomic_get(&o->core->failed))
+        return atomic_get(&o->core->failed) ? -1 : 0;
+
+    deadline = clock_msec() + msec;
+    mutex_lock(&q->lock);
+    atomic_set(&q->waiting, 1);
+    while (!(ready = !queue_empty(q)) && !atomic_get(&o->core->failed)) {
+        if (msec < 0) {
+            cond_wait_msec(&q->cond, &q->lock, -1);
+        } else {
+            double left = deadline - clock_msec();
+            if (left <= 0)
+                break;
+            cond_wait_msec(&q->cond, &q->lock, (int)left + 1);
+        }
+    }
+    atomic_set(&q->waiting, 0);
+    mutex_unlock(&q->lock);
+
+    if (ready)
+        return queue_pop(q, buf, size, time);
+    return atomic_get(&o->core->failed) ? -1 : 0;
+}
+
+/* as dev_read_raw(), but reports rejected by the handle's filter are
+ * consumed here and do not count as arrivals
+ */
+static int dev_read_report(HidDevice_Obj *o, int id, unsigned char *buf, int size,
+                           int msec, double *time)
+{
+    double deadline = clock_msec() + msec;
+
+    for (;;) {
+        int res = dev_read_raw(o, id, buf, size, msec, time);
+        if (res <= 0 || !o->filter || filter_pass(o->filter, buf, res))
+            return res;
+        if (msec > 0) {
+            msec = (int)(deadline - clock_msec());
+            if (msec <= 0)
+                return 0;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------
+ * helpers for reading fields of an options table at index idx
+ *----------------------------------------------------------------------
+ */
+
+static int opt_integer(lua_State *L, int idx, const char *key, int def)
+{
+    int v = def;
+    lua_getfield(L, idx, key);
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isnumber(L, -1))
+            luaL_error(L, "option '%s' must be a number", key);
+        v = (int)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    return v;
+}
+
+static int opt_boolean(lua_State *L, int idx, const char *key, int def)
+{
+    int v = def;
+    lua_getfield(L, idx, key);
+    if (!lua_isnil(L, -1))
+        v = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return v;
+}
+
+/* the string stays valid as long as the options table does
+ */
+static const char *opt_lstring(lua_State *L, int idx, const char *key,
+                               const char *def, size_t *len)
+{
+    const char *v = def;
+    if (len)
+        *len = def ? strlen(def) : 0;
+    lua_getfield(L, idx, key);
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isstring(L, -1))
+            luaL_error(L, "option '%s' must be a string", key);
+        v = lua_tolstring(L, -1, len);
+    }
+    lua_pop(L, 1);
+    return v;
+}
+
+static int opt_option(lua_State *L, int idx, const char *key,
+                      const char *def, const char *const lst[])
+{
+    int i;
+    const char *name = opt_lstring(L, idx, key, def, NULL);
+    if (!name)
+        luaL_error(L, "option '%s' is required", key);
+    for (i = 0; lst[i]; i++) {
+        if (strcmp(lst[i], name) == 0)
+            return i;
+    }
+    return luaL_error(L, "invalid value '%s' for option '%s'", name, key);
+}
+
+/* parse an array of field specs {offset=n, type="u8"[, name="x"]} at
+ * index idx into f[], which has room for lua_objlen(L, idx) entries
+ */
+static void opt_fields(lua_State *L, int idx, HidField *f)
+{
+    int i;
+    int n = (int)lua_objlen(L, idx);
+
+    for (i = 0; i < n; i++) {
+        const char *name;
+        lua_rawgeti(L, idx, i + 1);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "field %d must be a table", i + 1);
+        f[i].offset = opt_integer(L, -1, "offset", -1);
+        f[i].type = opt_option(L, -1, "type", "u8", field_types);
+        if (f[i].offset < 0 ||
+            f[i].offset + field_width[f[i].type] > HID_REPORT_MAXLEN)
+            luaL_error(L, "field %d has an invalid offset", i + 1);
+        name = opt_lstring(L, -1, "name", "", NULL);
+        strncpy(f[i].name, name, FIELD_NAME_MAXLEN);
+        f[i].name[FIELD_NAME_MAXLEN] = '\0';
+        lua_pop(L, 1);
+    }
+}
+
+/*----------------------------------------------------------------------
+ * hid.init()
+ * Initializes hidapi library.
+ * Returns true if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_init(lua_State *L)
+{
+    if (hid_init() == 0) {
+        lua_pushboolean(L, TRUE);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.exit()
+ * Cleans up and terminates hidapi library.
+ * Returns true if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_exit(lua_State *L)
+{
+    if (hid_exit() == 0) {
+        lua_pushboolean(L, TRUE);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * definitions for HID Device Enumeration object
+ *----------------------------------------------------------------------
+ */
+
+#define HIDAPI_LIB_HIDENUM      "HIDAPI_HIDENUM"
+
+enum {
+    HIDENUM_CLOSE = 0,
+    HIDENUM_OPEN,
+    HIDENUM_DONE,
+    /* error state is unused, since the enumeration is done once
+     * and the returned linked list will not cause errors
+     */
+    HIDENUM_ERROR,
+};
+
+typedef struct HidEnum_Obj {
+    int state;
+    struct hid_device_info *dev_info;
+} HidEnum_Obj;
+
+#define to_HidEnum_Obj(L) ((HidEnum_Obj *)luaL_checkudata(L, 1, HIDAPI_LIB_HIDENUM))
+
+/* validate object type+existence
+ */
+static HidEnum_Obj *check_HidEnum_Obj(lua_State *L)
+{
+    HidEnum_Obj *o = to_HidEnum_Obj(L);
+    if (o->state == HIDENUM_CLOSE)
+        luaL_error(L, "attempt to use a closed object");
+    return o;
+}
+
+/*----------------------------------------------------------------------
+ * e = hid.enumerate(vid, pid)
+ * e = hid.enumerate()
+ * Returns a HID device enumeration object for HID devices that matches
+ * given vid, pid pair. Enumerates all HID devices if no arguments
+ * provided or (0,0) used.
+ * IMPORTANT: Mouse and keyboard devices are not visible on Windows
+ * Returns nil if failed.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_enumerate(lua_State *L)
+{
+    HidEnum_Obj *o;
+    int n = lua_gettop(L);  /* number of arguments */
+    unsigned short vendor_id = 0;
+    unsigned short product_id = 0;
+
+    if (n == 2) {
+        lua_Integer id;
+
+        /* validate range of vid, pid */
+        id = luaL_checkinteger(L, 1);
+        if (id < 0 || id > 0xFFFF)
+            goto error_handler;
+        vendor_id = (unsigned short)id;
+
+        id = luaL_checkinteger(L, 2);
+        if (id < 0 || id > 0xFFFF)
+            goto error_handler;
+        product_id = (unsigned short)id;
+
+    } else if (n != 0) {
+        goto error_handler;
+    }
+    HIDAPI_PROBE2(enumerate_entry, vendor_id, product_id);
+
+    /* prepare object, state */
+    o = (HidEnum_Obj *)lua_newuserdata(L, sizeof(HidEnum_Obj));
+    o->state = HIDENUM_CLOSE;
+    luaL_getmetatable(L, HIDAPI_LIB_HIDENUM);
+    lua_setmetatable(L, -2);
+
+    /* set up HID device enumeration */
+    o->dev_info = hid_enumerate(vendor_id, product_id);
+    HIDAPI_PROBE3(enumerate_return, vendor_id, product_id, o->dev_info != NULL);
+    if (o->dev_info == NULL) {
+        goto error_handler;
+    }
+    o->state = HIDENUM_OPEN;
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * simple wchar_t[] to char[] conversion, returns a string
+ * - exposing wchar_t[] to Lua is messy, must consider cross-platform
+ *   sizes of wchar_t, so here is a quickie but crippled solution...
+ *----------------------------------------------------------------------
+ */
+
+static void forced_ascii(char *d, const wchar_t *s)
+{
+    size_t n;
+    unsigned int i;
+
+    if (!s) {                   /* check for NULL case */
+        d[0] = '\0';
+        return;
+    }
+    n = wcslen(s);
+    if (n > USB_STR_MAXLEN) n = USB_STR_MAXLEN;
+
+    for (i = 0; i < n; i++) {
+        wchar_t wc = s[i];
+        char c = wc & 0x7F;     /* zap all de funny chars */
+        if (wc > 127 || (wc > 0 && wc < 32)) {
+            c = '?';
+        }
+        d[i] = c;
+    }
+    d[i] = '\0';
+}
+
+static void push_forced_ascii(lua_State *L, const wchar_t *s)
+{
+    char d[USB_STR_MAXLEN + 1];
+    forced_ascii(d, s);
+    lua_pushstring(L, d);
+}
+
+/*----------------------------------------------------------------------
+ * e:next()
+ * Returns next HID device found, nil if no more.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_enum_next(lua_State *L)
+{
+    struct hid_device_info *dinfo;
+
+    /* validate object */
+    HidEnum_Obj *o = check_HidEnum_Obj(L);
+    if (o->state == HIDENUM_DONE) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* create device info table */
+    dinfo = o->dev_info;
+    lua_createtable(L, 0, 10);  /* 10 = number of fields */
+
+    lua_pushstring(L, dinfo->path);
+    lua_setfield(L, -2, "path");
+    lua_pushinteger(L, dinfo->vendor_id);
+    lua_setfield(L, -2, "vid");
+    lua_pushinteger(L, dinfo->product_id);
+    lua_setfield(L, -2, "pid");
+
+    push_forced_ascii(L, dinfo->serial_number);
+    lua_setfield(L, -2, "serial_number");
+
+    lua_pushinteger(L, dinfo->release_number);
+    lua_setfield(L, -2, "release");
+
+    push_forced_ascii(L, dinfo->manufacturer_string);
+    lua_setfield(L, -2, "manufacturer_string");
+    push_forced_ascii(L, dinfo->product_string);
+    lua_setfield(L, -2, "product_string");
+
+    lua_pushinteger(L, dinfo->usage_page);
+    lua_setfield(L, -2, "usage_page");
+    lua_pushinteger(L, dinfo->usage);
+    lua_setfield(L, -2, "usage");
+    lua_pushinteger(L, dinfo->interface_number);
+    lua_setfield(L, -2, "interface");
+
+    /* next HID device entry */
+    o->dev_info = dinfo->next;
+    if (o->dev_info == NULL) {
+        o->state = HIDENUM_DONE;
+    }
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * e:close()
+ * Close enumeration object. Always succeeds.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_enum_close(lua_State *L)
+{
+    HidEnum_Obj *o = check_HidEnum_Obj(L);
+    if (o->state != HIDENUM_CLOSE) {
+        hid_free_enumeration(o->dev_info);
+    }
+    o->state = HIDENUM_CLOSE;
+    return 0;
+}
+
+/*----------------------------------------------------------------------
+ * GC method for HidEnum_Obj
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_enum_meta_gc(lua_State *L)
+{
+    HidEnum_Obj *o = to_HidEnum_Obj(L);
+    if (o->state != HIDENUM_CLOSE) {
         hid_free_enumeration(o->dev_info);
     }
-    o->state = HIDENUM_CLOSE;
-    return 0;
+    o->state = HIDENUM_CLOSE;
+    return 0;
+}
+
+/*----------------------------------------------------------------------
+ * register and create metatable for HIDENUM object
+ *----------------------------------------------------------------------
+ */
+
+static const struct luaL_reg hidenum_meta_reg[] = {
+    {"next",  hidapi_enum_next},
+    {"close", hidapi_enum_close},
+    {"__gc",  hidapi_enum_meta_gc},
+    {NULL, NULL},
+};
+
+static void hidapi_create_hidenum_obj(lua_State *L) {
+    luaL_newmetatable(L, HIDAPI_LIB_HIDENUM);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, hidenum_meta_reg);
+}
+
+/*----------------------------------------------------------------------
+ * dev = hid.open(path)
+ * dev = hid.open(vid, pid)
+ * Opens a HID device using a path name or a vid, pid pair. Returns
+ * a HID device object if successful. Specification of a serial number
+ * is currently unimplemented (it uses wchar_t).
+ * IMPORTANT: Mouse and keyboard devices are not visible on Windows
+ * Returns nil if failed.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_open(lua_State *L)
+{
+    char path[HIDCORE_PATH_MAXLEN + 1];
+    hid_device *dev;
+    HidCore *core;
+    HidDevice_Obj *o;
+    unsigned short vendor_id = 0;
+    unsigned short product_id = 0;
+    int n = lua_gettop(L);  /* number of arguments */
+
+    if (n == 2 && lua_isnumber(L, 1) && lua_isnumber(L, 2)) {
+        /* validate, then attempt to open using pid, vid pair */
+        lua_Integer id;
+
+        id = luaL_checkinteger(L, 1);
+        if (id < 0 || id > 0xFFFF)
+            goto error_handler;
+
+        vendor_id = (unsigned short)id;
+        id = luaL_checkinteger(L, 2);
+        if (id < 0 || id > 0xFFFF)
+            goto error_handler;
+
+        product_id = (unsigned short)id;
+        snprintf(path, sizeof(path), "%04x:%04x", vendor_id, product_id);
+        HIDAPI_PROBE3(open_entry, (const char *)path, vendor_id, product_id);
+        dev = hid_open(vendor_id, product_id, NULL);
+
+    } else if (n == 2 && lua_isstring(L, 1)) {
+        /* attempt to open using a given path */
+        const char *dpath = lua_tostring(L, 1);
+
+        strncpy(path, dpath, HIDCORE_PATH_MAXLEN);
+        path[HIDCORE_PATH_MAXLEN] = '\0';
+        HIDAPI_PROBE3(open_entry, (const char *)path, vendor_id, product_id);
+        dev = hid_open_path(dpath);
+    } else
+        goto error_handler;
+    HIDAPI_PROBE4(open_return, (const char *)path, vendor_id, product_id, dev != NULL);
+    if (!dev)
+        goto error_handler;
+
+    /* handle is valid, prepare core and object */
+    core = core_new(dev);
+    if (!core) {
+        hid_close(dev);
+        goto error_handler;
+    }
+    strcpy(core->path, path);
+    o = (HidDevice_Obj *)lua_newuserdata(L, sizeof(HidDevice_Obj));
+    o->device = dev;
+    o->core = core;
+    o->queue = NULL;
+    o->filter = NULL;
+    o->agg = NULL;
+    o->nonblock = 0;
+    o->latest = 0;
+    luaL_getmetatable(L, HIDAPI_LIB_HIDDEVICE);
+    lua_setmetatable(L, -2);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.write(dev, report_id, report)
+ * dev:write(report_id, report)
+ *      report_id       - report ID of this write
+ *      report          - report data as a string
+ * hid.write(dev, report)
+ * dev:write(report)
+ *      a report ID of 0 is implied if it is left out
+ *      report          - report data as a string
+ * If output coalescing is on (see coalesce), the report only replaces
+ * the pending report of its report ID, and the bytes queued are
+ * returned.
+ * Returns bytes sent if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_write(lua_State *L)
+{
+    int res;
+    char *rdata;
+    size_t rsize;
+    size_t txsize;
+    unsigned int i;
+    unsigned char *txdata;
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    int n = lua_gettop(L);  /* number of arguments */
+    int rid = 0;
+    int rsrc = 3;
+
+    if (n == 2 && lua_isstring(L, 2)) {
+        /* no report ID, report only */
+        rsrc = 2;
+    } else {
+        /* report ID and report */
+        rid = luaL_checkinteger(L, 2);
+    }
+    rdata = (char *)luaL_checklstring(L, rsrc, &rsize);
+
+    /* report ID range check */
+    if (rid < 0 || rid > 0xFF)
+        goto error_handler;
+
+    /* prepare buffer for report transmit */
+    txsize = rsize + 1;
+    txdata = (unsigned char *)lua_newuserdata(L, txsize);
+    txdata[0] = rid;
+    for (i = 0; i < rsize; i++)
+        txdata[i + 1] = rdata[i];
+
+    /* send, unless coalesced */
+    HIDAPI_PROBE4(write_entry, dev_path(o), rid, txsize, 0);
+    if (coalesce_put(o->core, txdata, (int)txsize) == 0) {
+        HIDAPI_PROBE5(write_return, dev_path(o), rid, txsize, 0, txsize);
+        lua_pushinteger(L, txsize);
+        return 1;
+    }
+    dev_lock(o);
+    res = hid_write(o->device, txdata, txsize);
+    dev_unlock(o);
+    HIDAPI_PROBE5(write_return, dev_path(o), rid, txsize, 0, res);
+    if (res < 0)
+        goto error_handler;
+    lua_pushinteger(L, res);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.read(dev, report_size[, timeout_msec[, options]])
+ * dev:read(report_size[, timeout_msec[, options]])
+ *      report_size     - size of the read report buffer
+ *      timeout_msec    - optional timeout in milliseconds
+ *      options.id      - read from the queue of this report ID, which
+ *                        must have been set up with demux()
+ * If device has multiple reports, the first byte returned will be the
+ * report ID and one extra byte need to be allocated via report_size.
+ * For a normal call, timeout_msec can be omitted and blocking will
+ * depend on the selected option setting.
+ * Specifying a timeout_msec of -1 selects a blocking wait.
+ * On a shared device, reports come from this handle's input queue.
+ * Reports dropped by a filter (see setfilter) are skipped.
+ * Returns report as a string if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_read(lua_State *L)
+{
+    int res;
+    unsigned char *rxdata;
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    int n = lua_gettop(L);  /* number of arguments */
+    int timeout = o->nonblock ? 0 : -1;
+    int rid = -1;
+
+    int rxsize = luaL_checkinteger(L, 2);
+    if (rxsize < 0)
+        goto error_handler;
+
+    if (n >= 3 && !lua_isnil(L, 3)) {   /* get optional timeout */
+        timeout = luaL_checkinteger(L, 3);
+    }
+    if (n >= 4 && !lua_isnil(L, 4)) {   /* get optional report ID queue */
+        HidIdQueue *iq;
+        luaL_checktype(L, 4, LUA_TTABLE);
+        rid = opt_integer(L, 4, "id", -1);
+        if (rid < 1 || rid > 0xFF)
+            goto error_handler;
+        iq = (HidIdQueue *)atomic_getptr(&o->core->idq[rid]);
+        if (!iq || !atomic_get(&iq->enabled))
+            goto error_handler;
+    }
+
+    /* prepare buffer for report receive */
+    rxdata = (unsigned char *)lua_newuserdata(L, rxsize);
+
+    /* receive */
+    HIDAPI_PROBE4(read_entry, dev_path(o), rid, rxsize, timeout);
+    res = dev_read_report(o, rid, rxdata, rxsize, timeout, NULL);
+    HIDAPI_PROBE5(read_return, dev_path(o), rid, rxsize, timeout, res);
+    if (res < 0)
+        goto error_handler;
+    lua_pushlstring(L, (char *)rxdata, res);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.set(dev, option)
+ * dev:set(option)
+ * Set device options:
+ *      "block"   - reads will block
+ *      "noblock" - reads will return immediately even if no data
+ *      "latest"  - a native reader thread keeps only the newest report
+ *                  per report ID, see latest(); this handle stops
+ *                  queueing input and read() fails
+ *      "queue"   - this handle queues input again after "latest";
+ *                  once no handle of the device is in latest mode
+ *                  (closed handles count as left), the reader thread
+ *                  stops updating the latest-value slots
+ * On a shared device, blocking is set per handle.
+ * Returns true if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+enum {
+    DEV_SET_BLOCK = 0,
+    DEV_SET_NOBLOCK,
+    DEV_SET_LATEST,
+    DEV_SET_QUEUE
+};
+
+static int hidapi_set(lua_State *L)
+{
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+
+    static const char *const settings[] = {
+        "block", "noblock", "latest", "queue", NULL
+    };
+    int op = luaL_checkoption(L, 2, NULL, settings);
+    int nonblock;
+
+    if (op == DEV_SET_LATEST) {
+        if (!o->latest) {
+            atomic_inc(&o->core->latest_on);
+            o->latest = 1;
+        }
+        if (o->queue) {
+            core_detach(o->core, o->queue);
+            queue_free(o->queue);
+            o->queue = NULL;
+        }
+        if (core_start(o->core) < 0) {
+            lua_pushnil(L);
+            return 1;
+        }
+        lua_pushboolean(L, TRUE);
+        return 1;
+    }
+    if (op == DEV_SET_QUEUE) {
+        if (o->latest) {        /* the last one out stops the updates */
+            atomic_dec(&o->core->latest_on);
+            o->latest = 0;
+        }
+        if (dev_start_reader(o) < 0) {
+            lua_pushnil(L);
+            return 1;
+        }
+        lua_pushboolean(L, TRUE);
+        return 1;
+    }
+
+    /* prepare parameter for blocking setting */
+    nonblock = 0;
+    if (op == DEV_SET_NOBLOCK)
+        nonblock = 1;
+
+    /* perform blocking setting; once the reader thread owns input,
+     * blocking is a per-handle matter handled by the queue */
+    if (!atomic_get(&o->core->running)) {
+        int res;
+        dev_lock(o);
+        res = hid_set_nonblocking(o->device, nonblock);
+        dev_unlock(o);
+        if (res < 0) {
+            lua_pushnil(L);
+            return 1;
+        }
+    }
+    o->nonblock = nonblock;
+    lua_pushboolean(L, TRUE);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.latest(dev[, report_id])
+ * dev:latest([report_id])
+ *      report_id       - optional; if omitted, the newest report of any
+ *                        report ID (use this for devices without
+ *                        numbered reports)
+ * Needs latest mode, see set("latest"), on any handle of the device.
+ * Does not wait and does not touch the device.
+ * Returns the newest report as a string, its timestamp (see hid.clock())
+ * and its sequence number (count of such reports so far); nil if no
+ * such report has arrived yet or latest mode is off. After latest mode
+ * is turned on again, a report kept from before may be returned until
+ * a new one arrives.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_latest(lua_State *L)
+{
+    unsigned char data[HID_REPORT_MAXLEN];
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidLatest *l;
+    double time;
+    long seq;
+    int size;
+
+    int rid = luaL_optinteger(L, 2, LATEST_ANY);
+    if (rid < 0 || rid > LATEST_ANY)
+        goto error_handler;
+    if (!atomic_get(&o->core->latest_on))
+        goto error_handler;
+    l = (HidLatest *)atomic_getptr(&o->core->latest[rid]);
+    if (!l)
+        goto error_handler;
+
+    seq = latest_load(l, data, &size, &time);
+    if (seq == 0)
+        goto error_handler;
+    lua_pushlstring(L, (char *)data, size);
+    lua_pushnumber(L, time);
+    lua_pushnumber(L, (lua_Number)seq);
+    return 3;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.getstring(dev, option)
+ * dev:getstring(option)
+ * Get device string options:
+ *      "manufacturer"  - manufacturer string
+ *      "product"       - product string
+ *      "serial"        - serial string
+ *      or an integer signifying a string index
+ * Returns the string if successful, nil on failure.
+ * String are forcibly converted to ASCII.
+ *----------------------------------------------------------------------
+ */
+
+enum {
+    DEV_GETSTR_MANUFACTURER = 0,
+    DEV_GETSTR_PRODUCT,
+    DEV_GETSTR_SERIAL_NUMBER
+};
+
+static int hidapi_getstring(lua_State *L)
+{
+    int res;
+    wchar_t ws[USB_STR_MAXLEN] = {0};
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+
+    static const char *const settings[] = {
+        "manufacturer", "product", "serial_number", NULL
+    };
+
+    if (lua_isnumber(L, 2)) {
+        /* indexed USB strings */
+        int strid = luaL_checkinteger(L, 2);
+        dev_lock(o);
+        res = hid_get_indexed_string(o->device, strid, ws, USB_STR_MAXLEN);
+        dev_unlock(o);
+    } else {
+        /* named (standard) USB strings */
+        int op = luaL_checkoption(L, 2, NULL, settings);
+        dev_lock(o);
+        if (op == DEV_GETSTR_MANUFACTURER) {
+            res = hid_get_manufacturer_string(o->device, ws, USB_STR_MAXLEN);
+        } else if (op == DEV_GETSTR_PRODUCT) {
+            res = hid_get_product_string(o->device, ws, USB_STR_MAXLEN);
+        } else { /* (op == DEV_GETSTR_SERIAL_NUMBER) */
+            res = hid_get_serial_number_string(o->device, ws, USB_STR_MAXLEN);
+        }
+        dev_unlock(o);
+    }
+    if (res < 0)
+        goto error_handler;
+    push_forced_ascii(L, ws);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.setfeature(dev, feature_id, feature_data)
+ * dev:setfeature(feature_id, feature_data)
+ *      feature_id      - feature report ID, 1-byte range
+ *      feature_data    - string containing feature report data
+ * Set (send) a feature report. A 0 is used for a single report ID.
+ * Returns bytes sent if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_setfeature(lua_State *L)
+{
+    int res;
+    char *fdata;
+    size_t fsize;
+    size_t txsize;
+    unsigned int i;
+    unsigned char *txdata;
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+
+    /* feature report ID check */
+    int fid = luaL_checkinteger(L, 2);
+    if (fid < 0 || fid > 0xFF)
+        goto error_handler;
+
+    fdata = (char *)luaL_checklstring(L, 3, &fsize);
+
+    /* prepare buffer for report transmit */
+    txsize = fsize + 1;
+    txdata = (unsigned char *)lua_newuserdata(L, txsize);
+    txdata[0] = fid;
+    for (i = 0; i < fsize; i++)
+        txdata[i + 1] = fdata[i];
+
+    /* send */
+    HIDAPI_PROBE4(setfeature_entry, dev_path(o), fid, txsize, 0);
+    dev_lock(o);
+    res = hid_send_feature_report(o->device, txdata, txsize);
+    dev_unlock(o);
+    HIDAPI_PROBE5(setfeature_return, dev_path(o), fid, txsize, 0, res);
+    if (res < 0)
+        goto error_handler;
+    lua_pushinteger(L, res);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.getfeature(dev, feature_id, feature_size)
+ * dev:getfeature(feature_id, feature_size)
+ *      feature_id      - feature report ID, 1-byte range
+ *      feature_size    - size of read buffer, may be larger than the
+ *                        actual feature report
+ * Get a feature report. A 0 is used for a single report ID.
+ * Returns feature report as a string if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_getfeature(lua_State *L)
+{
+    int res;
+    int fsize;
+    size_t rxsize;
+    unsigned char *rxdata;
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+
+    /* feature report ID check */
+    int fid = luaL_checkinteger(L, 2);
+    if (fid < 0 || fid > 0xFF)
+        goto error_handler;
+
+    fsize = luaL_checkinteger(L, 3);
+    if (fsize < 0)
+        goto error_handler;
+
+    /* prepare buffer for report receive */
+    rxsize = fsize + 1;
+    rxdata = (unsigned char *)lua_newuserdata(L, rxsize);
+    rxdata[0] = fid;
+
+    /* receive */
+    HIDAPI_PROBE4(getfeature_entry, dev_path(o), fid, rxsize, 0);
+    dev_lock(o);
+    res = hid_get_feature_report(o->device, rxdata, rxsize);
+    dev_unlock(o);
+    HIDAPI_PROBE5(getfeature_return, dev_path(o), fid, rxsize, 0, res);
+    if (res < 0)
+        goto error_handler;
+    lua_pushlstring(L, (char *)rxdata, res);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.error(dev)
+ * dev:error()
+ * Returns a string describing the last error, or nil if there was no
+ * error. Error string is forcibly converted to ASCII.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_error(lua_State *L)
+{
+    char d[USB_STR_MAXLEN + 1];
+    const wchar_t *err;
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+
+    /* copy out under the lock, the string belongs to the device */
+    dev_lock(o);
+    err = hid_error(o->device);
+    if (err)
+        forced_ascii(d, err);
+    dev_unlock(o);
+    if (err) {
+        lua_pushstring(L, d);
+        return 1;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.close(dev)
+ * dev:close()
+ * Close HID device object. Always succeeds.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_close(lua_State *L)
+{
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    dev_detach(o);
+    return 0;
+}
+
+/*----------------------------------------------------------------------
+ * hid.waitfor(dev, report_id, mask, value[, timeout_msec])
+ * dev:waitfor(report_id, mask, value[, timeout_msec])
+ *      report_id       - report ID to wait for, 0 for any report (and
+ *                        for devices without numbered reports)
+ *      mask            - string, byte i masks byte i of the report as
+ *                        returned by read
+ *      value           - string, expected value of the masked bytes
+ *      timeout_msec    - optional, -1 (default) waits forever
+ * Reads reports natively, discarding those that do not match, until a
+ * report with (report & mask) == (value & mask) arrives.
+ * Returns the report as a string, its timestamp (see hid.clock()) and
+ * the number of discarded reports if successful; false and the number
+ * of discarded reports on timeout; nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_waitfor(lua_State *L)
+{
+    unsigned char rxdata[HID_REPORT_MAXLEN];
+    const char *mask, *value;
+    size_t masklen, valuelen;
+    unsigned long discarded = 0;
+    double deadline, time;
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+
+    int rid = luaL_checkinteger(L, 2);
+    int timeout = luaL_optinteger(L, 5, -1);
+    mask = luaL_checklstring(L, 3, &masklen);
+    value = luaL_checklstring(L, 4, &valuelen);
+    if (rid < 0 || rid > 0xFF || masklen > HID_REPORT_MAXLEN)
+        goto error_handler;
+
+    deadline = clock_msec() + timeout;
+    for (;;) {
+        int res = dev_read_report(o, rid, rxdata, sizeof(rxdata), timeout, &time);
+        if (res < 0)
+            goto error_handler;
+        if (res > 0) {
+            if (report_matches(rxdata, res, rid,
+                               (const unsigned char *)mask, (int)masklen,
+                               (const unsigned char *)value, (int)valuelen)) {
+                lua_pushlstring(L, (char *)rxdata, res);
+                lua_pushnumber(L, time);
+                lua_pushnumber(L, (lua_Number)discarded);
+                return 3;
+            }
+            discarded++;
+        }
+        if (timeout >= 0) {
+            timeout = (int)(deadline - clock_msec());
+            if (timeout <= 0 && res == 0)
+                break;
+            if (timeout < 0)
+                timeout = 0;
+        }
+    }
+    lua_pushboolean(L, 0);
+    lua_pushnumber(L, (lua_Number)discarded);
+    return 2;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.sendblob(dev, data, options)
+ * dev:sendblob(data, options)
+ *      data             - string to send
+ *      options.ack      - table describing acknowledgement reports:
+ *                         seq   - byte offset of the acknowledged
+ *                                 sequence number in the input report
+ *                                 as returned by read
+ *                         id    - optional input report ID, 0 for any
+ *                         mask, value - optional strings, as waitfor()
+ *      options.chunk    - payload bytes per report, default 63
+ *      options.window   - max unacknowledged reports, 1-128, default 8
+ *      options.id       - report ID of the chunk reports, default 0
+ *      options.via      - "output" (default) or "feature" reports
+ *      options.timeout  - retransmit timeout in msec, default 100
+ *      options.retries  - max retransmits per chunk, default 5
+ * Sends data as a sequence of reports, each holding a sequence number
+ * (chunk index mod 256) followed by one chunk of payload, the last one
+ * zero padded. Up to window reports are in flight; each is acked
+ * individually by an input report carrying its sequence number, and
+ * resent on timeout. Output coalescing does not apply.
+ * Returns the number of data bytes and the number of retransmits if
+ * successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+#define BLOB_MAXWINDOW 128      /* keeps sequence numbers unambiguous */
+
+enum {
+    BLOB_VIA_OUTPUT = 0,
+    BLOB_VIA_FEATURE
+};
+
+typedef struct HidBlobChunk {
+    double deadline;
+    int tries;
+    int acked;
+} HidBlobChunk;
+
+static int blob_send(HidDevice_Obj *o, int via, int id, const char *data, size_t len,
+                     int chunk, unsigned long k, unsigned char *txdata)
+{
+    size_t off = (size_t)k * chunk;
+    size_t n = len - off < (size_t)chunk ? len - off : (size_t)chunk;
+    int res;
+
+    txdata[0] = id;
+    txdata[1] = (unsigned char)k;
+    memcpy(txdata + 2, data + off, n);
+    memset(txdata + 2 + n, 0, chunk - n);
+    dev_lock(o);
+    if (via == BLOB_VIA_FEATURE)
+        res = hid_send_feature_report(o->device, txdata, chunk + 2);
+    else
+        res = hid_write(o->device, txdata, chunk + 2);
+    dev_unlock(o);
+    return res;
+}
+
+static int hidapi_sendblob(lua_State *L)
+{
+    static const char *const vias[] = {
+        "output", "feature", NULL
+    };
+    unsigned char rxdata[HID_REPORT_MAXLEN];
+    HidBlobChunk win[256];
+    const char *mask, *value;
+    size_t masklen, valuelen, len;
+    unsigned long total, base, next, k, retransmits = 0;
+    unsigned char *txdata;
+    int chunk, window, id, via, timeout, retries, ackid, ackseq;
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    const char *data = luaL_checklstring(L, 2, &len);
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+    chunk = opt_integer(L, 3, "chunk", 63);
+    window = opt_integer(L, 3, "window", 8);
+    id = opt_integer(L, 3, "id", 0);
+    via = opt_option(L, 3, "via", "output", vias);
+    timeout = opt_integer(L, 3, "timeout", 100);
+    retries = opt_integer(L, 3, "retries", 5);
+    lua_getfield(L, 3, "ack");
+    luaL_argcheck(L, lua_istable(L, -1), 3, "ack must be a table");
+    ackseq = opt_integer(L, -1, "seq", -1);
+    ackid = opt_integer(L, -1, "id", 0);
+    mask = opt_lstring(L, -1, "mask", "", &masklen);
+    value = opt_lstring(L, -1, "value", "", &valuelen);
+    if (chunk < 1 || chunk > HID_REPORT_MAXLEN || window < 1 || window > BLOB_MAXWINDOW ||
+        id < 0 || id > 0xFF || ackid < 0 || ackid > 0xFF || timeout < 1 || retries < 0 ||
+        ackseq < 0 || ackseq >= HID_REPORT_MAXLEN || masklen > HID_REPORT_MAXLEN)
+        goto error_handler;
+
+    /* one buffer: report ID, sequence number, payload */
+    txdata = (unsigned char *)lua_newuserdata(L, chunk + 2);
+    total = (unsigned long)((len + chunk - 1) / chunk);
+    base = next = 0;
+
+    while (base < total) {
+        double now, wait;
+        int res;
+
+        /* fill the window */
+        while (next < total && next - base < (unsigned long)window) {
+            HidBlobChunk *c = &win[next & 0xFF];
+            if (blob_send(o, via, id, data, len, chunk, next, txdata) < 0)
+                goto error_handler;
+            c->deadline = clock_msec() + timeout;
+            c->tries = 0;
+            c->acked = 0;
+            next++;
+        }
+
+        /* wait for an ack, at most until the earliest retransmit */
+        now = clock_msec();
+        wait = timeout;
+        for (k = base; k < next; k++) {
+            HidBlobChunk *c = &win[k & 0xFF];
+            if (!c->acked && c->deadline - now < wait)
+                wait = c->deadline - now;
+        }
+        res = dev_read_report(o, ackid, rxdata, sizeof(rxdata),
+                              wait > 0 ? (int)wait + 1 : 0, NULL);
+        if (res < 0)
+            goto error_handler;
+        if (res > ackseq &&
+            report_matches(rxdata, res, ackid,
+                           (const unsigned char *)mask, (int)masklen,
+                           (const unsigned char *)value, (int)valuelen)) {
+            /* map the sequence number into the window */
+            unsigned long a = base + (unsigned char)(rxdata[ackseq] - (unsigned char)base);
+            if (a < next)
+                win[a & 0xFF].acked = 1;
+            while (base < next && win[base & 0xFF].acked)
+                base++;
+        }
+
+        /* resend what timed out */
+        now = clock_msec();
+        for (k = base; k < next; k++) {
+            HidBlobChunk *c = &win[k & 0xFF];
+            if (c->acked || c->deadline > now)
+                continue;
+            if (c->tries >= retries)
+                goto error_handler;
+            if (blob_send(o, via, id, data, len, chunk, k, txdata) < 0)
+                goto error_handler;
+            c->tries++;
+            c->deadline = clock_msec() + timeout;
+            retransmits++;
+        }
+    }
+    lua_pushnumber(L, (lua_Number)len);
+    lua_pushnumber(L, (lua_Number)retransmits);
+    return 2;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.setfilter(dev, options)
+ * dev:setfilter(options)
+ *      options.mode     - "changed": drop input reports whose masked
+ *                         bytes equal the previous report with the same
+ *                         report ID; "none": no filtering (default)
+ *      options.mask     - optional string, byte i masks byte i of the
+ *                         report as returned by read (including the ID
+ *                         byte of numbered reports); bytes past the end
+ *                         of the mask are compared in full
+ *      options.numbered - true if the device uses report IDs, so that
+ *                         each ID is tracked separately
+ * hid.setfilter(dev)
+ * dev:setfilter()
+ *      removes the filter
+ * The filter applies to this handle's reads. Suppressed reports are
+ * counted, see stats(). Setting a filter resets its history and counts.
+ * Returns true if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_setfilter(lua_State *L)
+{
+    static const char *const modes[] = {
+        "none", "changed", NULL
+    };
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidFilter *f;
+    const char *mask;
+    size_t masklen;
+    int mode;
+
+    if (lua_isnoneornil(L, 2)) {
+        mode = FILTER_NONE;
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        mode = opt_option(L, 2, "mode", "none", modes);
+    }
+    if (o->filter) {
+        filter_free(o->filter);
+        o->filter = NULL;
+    }
+    if (mode == FILTER_NONE) {
+        lua_pushboolean(L, TRUE);
+        return 1;
+    }
+
+    mask = opt_lstring(L, 2, "mask", NULL, &masklen);
+    if (masklen > HID_REPORT_MAXLEN)
+        goto error_handler;
+    f = (HidFilter *)calloc(1, sizeof(HidFilter));
+    if (!f)
+        goto error_handler;
+    f->mode = mode;
+    f->numbered = opt_boolean(L, 2, "numbered", 0);
+    memset(f->mask, 0xFF, sizeof(f->mask));
+    if (mask)
+        memcpy(f->mask, mask, masklen);
+    o->filter = f;
+    lua_pushboolean(L, TRUE);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.stats(dev)
+ * dev:stats()
+ * Returns a table of input counters for this handle:
+ *      dropped         - reports lost to input queue overflow (shared
+ *                        devices only)
+ *      passed          - reports delivered by the filter
+ *      suppressed      - reports dropped by the filter
+ *      demux           - table of report ID queue overflow counts,
+ *                        indexed by report ID (see demux)
+ * and output counters for the device (see coalesce):
+ *      merged          - writes replaced by a later one before sending
+ *      flushed         - coalesced writes sent
+ *      write_errors    - coalesced writes that failed
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_stats(lua_State *L)
+{
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidCore *c = o->core;
+    unsigned long merged, flushed, wfailed;
+    int i;
+
+    mutex_lock(&c->wlock);
+    merged = c->merged;
+    flushed = c->flushed;
+    wfailed = c->wfailed;
+    mutex_unlock(&c->wlock);
+
+    lua_createtable(L, 0, 7);
+    lua_pushnumber(L, o->queue ? (lua_Number)atomic_get(&o->queue->dropped) : 0);
+    lua_setfield(L, -2, "dropped");
+    lua_pushnumber(L, o->filter ? (lua_Number)o->filter->passed : 0);
+    lua_setfield(L, -2, "passed");
+    lua_pushnumber(L, o->filter ? (lua_Number)o->filter->suppressed : 0);
+    lua_setfield(L, -2, "suppressed");
+    lua_newtable(L);
+    for (i = 1; i < 256; i++) {
+        HidIdQueue *iq = (HidIdQueue *)atomic_getptr(&o->core->idq[i]);
+        if (iq && atomic_get(&iq->enabled)) {
+            unsigned long dropped;
+            mutex_lock(&iq->lock);
+            dropped = iq->dropped;
+            mutex_unlock(&iq->lock);
+            lua_pushnumber(L, (lua_Number)dropped);
+            lua_rawseti(L, -2, i);
+        }
+    }
+    lua_setfield(L, -2, "demux");
+    lua_pushnumber(L, (lua_Number)merged);
+    lua_setfield(L, -2, "merged");
+    lua_pushnumber(L, (lua_Number)flushed);
+    lua_setfield(L, -2, "flushed");
+    lua_pushnumber(L, (lua_Number)wfailed);
+    lua_setfield(L, -2, "write_errors");
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.aggregate(dev, options)
+ * dev:aggregate(options)
+ *      options.fields    - array of field specs, each a table with:
+ *                          offset - byte offset in the report as
+ *                                   returned by read, 0-based
+ *                          type   - "u8", "s8", "u16", "s16", "u32",
+ *                                   "s32" (little endian), "u16be",
+ *                                   "s16be", "u32be", "s32be", "f32"
+ *                          name   - optional key in summary records
+ *      options.window_ms - window length in milliseconds
+ *      options.id        - optional report ID, 1-255; other reports
+ *                          are skipped (numbered reports only)
+ *      options.size      - optional report buffer size
+ * hid.aggregate(dev)
+ * dev:aggregate()
+ *      removes the aggregation stage
+ * Once set up, summary() consumes reports natively, one window at a
+ * time. The window starts now.
+ * Returns true if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_aggregate(lua_State *L)
+{
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidAgg *a;
+    int nfields;
+    int window;
+    int size;
+    int id;
+
+    free(o->agg);
+    o->agg = NULL;
+    if (lua_isnoneornil(L, 2)) {
+        lua_pushboolean(L, TRUE);
+        return 1;
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    window = opt_integer(L, 2, "window_ms", 0);
+    size = opt_integer(L, 2, "size", HID_REPORT_MAXLEN);
+    id = opt_integer(L, 2, "id", -1);
+    if (window <= 0 || size <= 0 || size > HID_REPORT_MAXLEN ||
+        (id != -1 && (id < 1 || id > 0xFF)))
+        goto error_handler;
+    lua_getfield(L, 2, "fields");
+    luaL_argcheck(L, lua_istable(L, -1), 2, "fields must be a table");
+    nfields = (int)lua_objlen(L, -1);
+    if (nfields == 0)
+        goto error_handler;
+
+    a = agg_new(nfields);
+    if (!a)
+        goto error_handler;
+    o->agg = a;                 /* owned by the object if parsing fails */
+    opt_fields(L, lua_gettop(L), a->field);
+    lua_pop(L, 1);
+    a->id = id;
+    a->size = size;
+    a->window = window;
+    agg_reset(a, clock_msec());
+    lua_pushboolean(L, TRUE);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.summary(dev)
+ * dev:summary()
+ * Reads and aggregates reports until the current window closes, then
+ * returns a summary record:
+ *      count           - number of reports in the window
+ *      t0, t1          - window start and end, see hid.clock()
+ *      [i]             - for field i, a table {min=, max=, mean=,
+ *                        count=}; min, max and mean are nil if the
+ *                        field was never seen; also stored under the
+ *                        field name, if given
+ * Reports are assigned to windows by arrival time; the first report
+ * past the window end is kept for the next call. If called late, the
+ * next window starts from now.
+ * Returns nil on a read error, or if no aggregation is set up.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_summary(lua_State *L)
+{
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidAgg *a = o->agg;
+    unsigned char *rxdata;
+    double end, now;
+    int i;
+
+    if (!a)
+        goto error_handler;
+    rxdata = (unsigned char *)lua_newuserdata(L, a->size);
+
+    /* consume reports until one arrives after the window closes; that
+     * one is held over, reports come in arrival order
+     */
+    end = a->start + a->window;
+    if (a->heldsize > 0 && a->heldtime < end) {
+        agg_add(a, a->held, a->heldsize);
+        a->heldsize = 0;
+    }
+    while (a->heldsize == 0) {
+        double time;
+        int res;
+        int msec = 0;
+        now = clock_msec();
+        if (now < end)
+            msec = (int)(end - now) + 1;
+        res = dev_read_report(o, a->id, rxdata, a->size, msec, &time);
+        if (res < 0)
+            goto error_handler;
+        if (res > 0 && time >= end) {
+            memcpy(a->held, rxdata, res);
+            a->heldsize = res;
+            a->heldtime = time;
+        } else if (res > 0) {
+            agg_add(a, rxdata, res);
+        } else if (msec == 0 || clock_msec() >= end) {
+            break;
+        }
+    }
+
+    /* build record */
+    lua_createtable(L, a->nfields, 3);
+    lua_pushnumber(L, (lua_Number)a->count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, a->start);
+    lua_setfield(L, -2, "t0");
+    lua_pushnumber(L, end);
+    lua_setfield(L, -2, "t1");
+    for (i = 0; i < a->nfields; i++) {
+        HidAggStat *st = &a->stat[i];
+        lua_createtable(L, 0, 4);
+        lua_pushnumber(L, (lua_Number)st->count);
+        lua_setfield(L, -2, "count");
+        if (st->count > 0) {
+            lua_pushnumber(L, st->min);
+            lua_setfield(L, -2, "min");
+            lua_pushnumber(L, st->max);
+            lua_setfield(L, -2, "max");
+            lua_pushnumber(L, st->sum / st->count);
+            lua_setfield(L, -2, "mean");
+        }
+        if (a->field[i].name[0]) {
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -3, a->field[i].name);
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    /* next window */
+    now = clock_msec();
+    agg_reset(a, now < end + a->window ? end : now);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * column extraction kernels
+ * - one type-specialized loop per field over the whole batch, writing
+ *   packed host-order values
+ * - fixed-size reports in one buffer use the strided kernels: no
+ *   per-report pointer or length, the field is checked against the
+ *   report size once, so the loop is branch-free
+ * - separate report strings use the gather kernels, where a report too
+ *   short for the field gives 0
+ *----------------------------------------------------------------------
+ */
+
+typedef void (*column_fn)(void *out, const unsigned char *const *rep,
+                          const size_t *len, size_t n, size_t off);
+typedef void (*column_strided_fn)(void *out, const unsigned char *base,
+                                  size_t stride, size_t n);
+
+static uint16_t get_u16le(const unsigned char *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static uint16_t get_u16be(const unsigned char *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint32_t get_u32le(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static uint32_t get_u32be(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+static float get_f32le(const unsigned char *p)
+{
+    uint32_t u = get_u32le(p);
+    float v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+#define COLUMN_KERNEL(name, ctype, get)                                 \
+static void name(void *out, const unsigned char *const *rep,            \
+                 const size_t *len, size_t n, size_t off)               \
+{                                                                       \
+    ctype *d = (ctype *)out;                                            \
+    size_t i;                                                           \
+    for (i = 0; i < n; i++)                                             \
+        d[i] = len[i] >= off + sizeof(ctype) ? (ctype)get(rep[i] + off) : 0; \
+}                                                                       \
+/* base points at the field in the first report */                     \
+static void name##_strided(void *out, const unsigned char *base,        \
+                           size_t stride, size_t n)                     \
+{                                                                       \
+    ctype *d = (ctype *)out;                                            \
+    size_t i;                                                           \
+    for (i = 0; i < n; i++)                                             \
+        d[i] = (ctype)get(base + i * stride);                           \
+}
+
+#define get_u8(p)   ((p)[0])
+
+COLUMN_KERNEL(column_u8, uint8_t, get_u8)
+COLUMN_KERNEL(column_s8, int8_t, get_u8)
+COLUMN_KERNEL(column_u16, uint16_t, get_u16le)
+COLUMN_KERNEL(column_s16, int16_t, get_u16le)
+COLUMN_KERNEL(column_u16be, uint16_t, get_u16be)
+COLUMN_KERNEL(column_s16be, int16_t, get_u16be)
+COLUMN_KERNEL(column_u32, uint32_t, get_u32le)
+COLUMN_KERNEL(column_s32, int32_t, get_u32le)
+COLUMN_KERNEL(column_u32be, uint32_t, get_u32be)
+COLUMN_KERNEL(column_s32be, int32_t, get_u32be)
+COLUMN_KERNEL(column_f32, float, get_f32le)
+
+/* indexed by field type */
+static const column_fn column_kernel[] = {
+    column_u8, column_s8,
+    column_u16, column_s16, column_u16be, column_s16be,
+    column_u32, column_s32, column_u32be, column_s32be,
+    column_f32
+};
+
+static const column_strided_fn column_strided_kernel[] = {
+    column_u8_strided, column_s8_strided,
+    column_u16_strided, column_s16_strided, column_u16be_strided, column_s16be_strided,
+    column_u32_strided, column_s32_strided, column_u32be_strided, column_s32be_strided,
+    column_f32_strided
+};
+
+/* NumPy dtype of a column, without the byte order character */
+static const char *const column_dtype[] = {
+    "u1", "i1",
+    "u2", "i2", "u2", "i2",
+    "u4", "i4", "u4", "i4",
+    "f4"
+};
+
+/* write a column as a NumPy .npy file (format version 1.0); returns 0
+ * if successful
+ */
+static int column_save(const char *path, int type, const void *data, size_t n)
+{
+    static const uint16_t one = 1;
+    char hdr[192];
+    size_t hlen, size = n * field_width[type];
+    FILE *f;
+    int res;
+
+    hlen = (size_t)sprintf(hdr + 10, "{'descr': '%c%s', 'fortran_order': False, 'shape': (%lu,), }",
+                           field_width[type] == 1 ? '|' : *(const char *)&one ? '<' : '>',
+                           column_dtype[type], (unsigned long)n);
+    /* pad the header with spaces to a multiple of 64, ending in \n */
+    while ((10 + hlen + 1) % 64)
+        hdr[10 + hlen++] = ' ';
+    hdr[10 + hlen++] = '\n';
+    memcpy(hdr, "\x93NUMPY\x01\x00", 8);
+    hdr[8] = (char)(hlen & 0xFF);
+    hdr[9] = (char)(hlen >> 8);
+
+    f = fopen(path, "wb");
+    if (!f)
+        return -1;
+    res = fwrite(hdr, 1, 10 + hlen, f) == 10 + hlen &&
+          fwrite(data, 1, size, f) == size;
+    if (fclose(f) != 0)
+        res = 0;
+    return res ? 0 : -1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.columns(reports, fields[, options])
+ *      reports           - array of reports as returned by read, or
+ *                          one string of back-to-back reports of
+ *                          options.size bytes each
+ *      fields            - array of field specs, as aggregate()
+ *      options.size      - report size, for a string of reports
+ *      options.file      - optional path prefix; field i is also
+ *                          written to <prefix><name>.npy (NumPy
+ *                          format), where name is the field name or
+ *                          "f<i>"
+ * Converts a batch of reports into one column per field: a string of
+ * packed values in the field's type, in host byte order (big endian
+ * fields are swapped), one per report. Reports too short for a field
+ * give 0 for it.
+ * Returns a table with column i at [i], and also under the field name
+ * if given, plus the number of reports; nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_columns(lua_State *L)
+{
+    char path[1024];
+    const unsigned char **rep = NULL;
+    const unsigned char *base = NULL;
+    const char *prefix;
+    size_t *len = NULL;
+    HidField *field;
+    size_t n, i;
+    int nfields, j, stride;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (!lua_isnoneornil(L, 3))
+        luaL_checktype(L, 3, LUA_TTABLE);
+    stride = lua_istable(L, 3) ? opt_integer(L, 3, "size", 0) : 0;
+    prefix = lua_istable(L, 3) ? opt_lstring(L, 3, "file", NULL, NULL) : NULL;
+    nfields = (int)lua_objlen(L, 2);
+    if (nfields == 0)
+        goto error_handler;
+    field = (HidField *)lua_newuserdata(L, nfields * sizeof(HidField));
+    opt_fields(L, 2, field);
+
+    /* fixed-size reports in one string, or gather report pointers */
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        size_t total;
+        base = (const unsigned char *)lua_tolstring(L, 1, &total);
+        if (stride <= 0)
+            goto error_handler;
+        n = total / stride;
+    } else {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        n = lua_objlen(L, 1);
+        rep = (const unsigned char **)lua_newuserdata(L, (n + 1) * sizeof(*rep));
+        len = (size_t *)lua_newuserdata(L, (n + 1) * sizeof(*len));
+        for (i = 0; i < n; i++) {
+            lua_rawgeti(L, 1, (int)i + 1);
+            if (lua_type(L, -1) != LUA_TSTRING)
+                luaL_error(L, "report %d must be a string", (int)i + 1);
+            /* still referenced by the reports table */
+            rep[i] = (const unsigned char *)lua_tolstring(L, -1, &len[i]);
+            lua_pop(L, 1);
+        }
+    }
+
+    /* extract */
+    lua_createtable(L, nfields, 0);
+    for (j = 0; j < nfields; j++) {
+        const HidField *f = &field[j];
+        void *out = lua_newuserdata(L, n * field_width[f->type] + 1);
+
+        if (!base)
+            column_kernel[f->type](out, rep, len, n, (size_t)f->offset);
+        else if (f->offset + field_width[f->type] <= stride)
+            column_strided_kernel[f->type](out, base + f->offset, (size_t)stride, n);
+        else
+            memset(out, 0, n * field_width[f->type]);
+        if (prefix) {
+            if (f->name[0])
+                snprintf(path, sizeof(path), "%s%s.npy", prefix, f->name);
+            else
+                snprintf(path, sizeof(path), "%sf%d.npy", prefix, j + 1);
+            if (column_save(path, f->type, out, n) != 0)
+                goto error_handler;
+        }
+        lua_pushlstring(L, (const char *)out, n * field_width[f->type]);
+        lua_remove(L, -2);
+        if (f->name[0]) {
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -3, f->name);
+        }
+        lua_rawseti(L, -2, j + 1);
+    }
+    lua_pushnumber(L, (lua_Number)n);
+    return 2;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
 }
 
 /*----------------------------------------------------------------------
- * register and create metatable for HIDENUM object
+ * hid.clock()
+ * Returns the monotonic clock used for report timestamps, in
+ * milliseconds (with a fractional part).
  *----------------------------------------------------------------------
  */
 
-static const struct luaL_reg hidenum_meta_reg[] = {
-    {"next",  hidapi_enum_next},
-    {"close", hidapi_enum_close},
-    {"__gc",  hidapi_enum_meta_gc},
-    {NULL, NULL},
-};
+static int hidapi_clock(lua_State *L)
+{
+    lua_pushnumber(L, clock_msec());
+    return 1;
+}
 
-static void hidapi_create_hidenum_obj(lua_State *L) {
-    luaL_newmetatable(L, HIDAPI_LIB_HIDENUM);
-    lua_pushvalue(L, -1);
-    lua_setfield(L, -2, "__index");
-    luaL_register(L, NULL, hidenum_meta_reg);
+/*----------------------------------------------------------------------
+ * hid.demux(dev, report_id[, options])
+ * dev:demux(report_id[, options])
+ *      report_id        - report ID, 1-255
+ *      options.capacity - queue capacity in reports, default 128
+ *      options.overflow - "drop_oldest" (default) or "drop_newest"
+ * hid.demux(dev, report_id, false)
+ * dev:demux(report_id, false)
+ *      stops sorting out this report ID
+ * For devices with numbered reports: reports with this ID are sorted
+ * natively into their own queue, read with read(size, timeout, {id=n})
+ * from any handle of the device; each report goes to one reader. Other
+ * reports are delivered as before. Starts the native reader thread.
+ * Setting up an existing queue again discards its content.
+ * Returns true if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_demux(lua_State *L)
+{
+    static const char *const policies[] = {
+        "drop_oldest", "drop_newest", NULL
+    };
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidIdQueue *iq;
+    int capacity = HIDQUEUE_DEPTH;
+    int overflow = OVERFLOW_DROP_OLDEST;
+
+    int rid = luaL_checkinteger(L, 2);
+    if (rid < 1 || rid > 0xFF)
+        goto error_handler;
+
+    if (lua_isboolean(L, 3) && !lua_toboolean(L, 3)) {
+        iq = (HidIdQueue *)atomic_getptr(&o->core->idq[rid]);
+        if (iq) {
+            atomic_set(&iq->enabled, 0);
+            idq_wake(iq);
+        }
+        lua_pushboolean(L, TRUE);
+        return 1;
+    }
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        capacity = opt_integer(L, 3, "capacity", HIDQUEUE_DEPTH);
+        overflow = opt_option(L, 3, "overflow", "drop_oldest", policies);
+    }
+    if (capacity < 1 || capacity > HIDQUEUE_MAXDEPTH)
+        goto error_handler;
+
+    iq = core_idq(o->core, rid);
+    if (!iq || idq_setup(iq, capacity, overflow) < 0)
+        goto error_handler;
+    if (dev_start_reader(o) < 0)
+        goto error_handler;
+    lua_pushboolean(L, TRUE);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
 }
 
 /*----------------------------------------------------------------------
- * dev = hid.open(path)
- * dev = hid.open(vid, pid)
- * Opens a HID device using a path name or a vid, pid pair. Returns
- * a HID device object if successful. Specification of a serial number
- * is currently unimplemented (it uses wchar_t).
- * IMPORTANT: Mouse and keyboard devices are not visible on Windows
- * Returns nil if failed.
+ * hid.coalesce(dev, interval_msec)
+ * dev:coalesce(interval_msec)
+ *      interval_msec   - flush interval, e.g. the device polling
+ *                        interval; 0 or false turns coalescing off
+ * Output report coalescing for the device: write() keeps only the last
+ * report per report ID, and a native writer thread sends pending
+ * reports every interval. Turning it off sends pending reports first.
+ * Merged, sent and failed writes are counted, see stats().
+ * Returns true if successful, nil on failure.
  *----------------------------------------------------------------------
  */
 
-static int hidapi_open(lua_State *L)
+static int hidapi_coalesce(lua_State *L)
 {
-    hid_device *dev;
-    HidDevice_Obj *o;
-    unsigned short vendor_id;
-    unsigned short product_id;
-    int n = lua_gettop(L);  /* number of arguments */
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    int interval = 0;
 
-    if (n == 2 && lua_isnumber(L, 1) && lua_isnumber(L, 2)) {
-        /* validate, then attempt to open using pid, vid pair */
-        lua_Integer id;
+    if (!lua_isboolean(L, 2) || lua_toboolean(L, 2))
+        interval = luaL_checkinteger(L, 2);
+    if (interval < 0)
+        goto error_handler;
+    if (interval == 0) {
+        coalesce_stop(o->core);
+    } else if (coalesce_start(o->core, interval) < 0) {
+        goto error_handler;
+    }
+    lua_pushboolean(L, TRUE);
+    return 1;
 
-        id = luaL_checkinteger(L, 1);
-        if (id < 0 || id > 0xFFFF)
-            goto error_handler;
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
 
-        vendor_id = (unsigned short)id;
-        id = luaL_checkinteger(L, 2);
-        if (id < 0 || id > 0xFFFF)
+/*----------------------------------------------------------------------
+ * hid.publish(dev, name, capacity[, report_size])
+ * dev:publish(name, capacity[, report_size])
+ *      name            - POSIX shared memory object name
+ *      capacity        - ring size in reports, rounded up to a power
+ *                        of 2
+ *      report_size     - optional max report size kept, default 64
+ * hid.publish(dev, false)
+ * dev:publish(false)
+ *      stops publishing and removes the shared memory object
+ * Copies every input report, with timestamp and sequence number, into
+ * a shared memory ring that other processes read with hid.subscribe().
+ * Starts the native reader thread; this handle then reads from its own
+ * input queue, as with share(). Publishing again under another name
+ * replaces the ring. Fails if a shared memory object of that name
+ * already exists, which includes the ring this device is publishing;
+ * to change its capacity, publish(false) first.
+ * Not available on Windows.
+ * Returns true if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_publish(lua_State *L)
+{
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+#ifdef HIDAPI_HAVE_SHM
+    HidCore *c = o->core;
+    HidShm *m = NULL;
+    HidShm *old;
+
+    if (!(lua_isboolean(L, 2) && !lua_toboolean(L, 2))) {
+        const char *name = luaL_checkstring(L, 2);
+        int capacity = luaL_checkinteger(L, 3);
+        int size = luaL_optinteger(L, 4, 64);
+        if (capacity < 1 || capacity > HIDQUEUE_MAXDEPTH ||
+            size < 1 || size > HID_REPORT_MAXLEN)
             goto error_handler;
+        m = shm_create(name, capacity, size);
+        if (!m)
+            goto error_handler;
+    }
 
-        product_id = (unsigned short)id;
-        dev = hid_open(vendor_id, product_id, NULL);
+    /* swap in the new ring, wait until the old one is out of use */
+    mutex_lock(&c->lock);
+    old = c->shm;
+    atomic_setptr(&c->shm, m);
+    mutex_unlock(&c->lock);
+    core_sync(c);
+    if (old)
+        shm_destroy(old);
 
-    } else if (n == 2 && lua_isstring(L, 1)) {
-        /* attempt to open using a given path */
-        const char *dpath = lua_tostring(L, 1);
+    if (m && dev_start_reader(o) < 0)
+        goto error_handler;
+    lua_pushboolean(L, TRUE);
+    return 1;
 
-        dev = hid_open_path(dpath);
-    } else
+error_handler:
+#else
+    (void)o;
+#endif
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * hid.share(dev[, queue_depth])
+ * dev:share([queue_depth])
+ *      queue_depth     - input queue depth of each attached handle,
+ *                        optional, default 128 reports
+ * Turns the device into a shared device that handles in other Lua
+ * states of the same process (e.g. Lua Lanes) can attach to with
+ * hid.attach(). A native reader thread then owns input, and each handle
+ * has its own input queue receiving a copy of every report; reports
+ * arriving at a full queue are dropped. Other calls on the device are
+ * serialized internally. Sharing an already shared device returns the
+ * existing token.
+ * Returns a numeric token if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_share(lua_State *L)
+{
+    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidCore *c = o->core;
+    int depth = luaL_optinteger(L, 2, HIDQUEUE_DEPTH);
+
+    if (depth < 1 || depth > HIDQUEUE_MAXDEPTH)
         goto error_handler;
-    if (!dev)
+
+    mutex_lock(&share_lock);
+    if (!c->token) {
+        c->token = ++share_token;
+        c->depth = depth;
+        c->next = share_list;
+        share_list = c;
+    }
+    mutex_unlock(&share_lock);
+
+    if (dev_start_reader(o) < 0)
+        goto error_handler;
+    lua_pushnumber(L, (lua_Number)c->token);
+    return 1;
+
+error_handler:
+    lua_pushnil(L);
+    return 1;
+}
+
+/*----------------------------------------------------------------------
+ * dev = hid.attach(token)
+ * Attaches to a device shared with hid.share(), from any Lua state in
+ * the same process. The new handle has its own input queue and
+ * blocking setting; the device is closed when its last handle is.
+ * Returns a HID device object if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_attach(lua_State *L)
+{
+    HidCore *c;
+    HidQueue *q;
+    HidDevice_Obj *o;
+    long token = (long)luaL_checknumber(L, 1);
+
+    /* look up token, taking a reference */
+    mutex_lock(&share_lock);
+    for (c = share_list; c; c = c->next) {
+        if (c->token == token) {
+            c->refcount++;
+            break;
+        }
+    }
+    mutex_unlock(&share_lock);
+    if (!c)
+        goto error_handler;
+
+    q = queue_new(c->depth);
+    if (!q) {
+        core_release(c);
+        goto error_handler;
+    }
+    if (core_attach(c, q) < 0) {
+        queue_free(q);
+        core_release(c);
         goto error_handler;
+    }
+    if (core_start(c) < 0) {    /* share() may have failed to start it */
+        core_detach(c, q);
+        queue_free(q);
+        core_release(c);
+        goto error_handler;
+    }
 
-    /* handle is valid, prepare object */
+    /* prepare object */
     o = (HidDevice_Obj *)lua_newuserdata(L, sizeof(HidDevice_Obj));
-    o->device = dev;
+    o->device = c->device;
+    o->core = c;
+    o->queue = q;
+    o->filter = NULL;
+    o->agg = NULL;
+    o->nonblock = 0;
+    o->latest = 0;
     luaL_getmetatable(L, HIDAPI_LIB_HIDDEVICE);
     lua_setmetatable(L, -2);
     return 1;
@@ -383,356 +3498,555 @@ error_handler:
 }
 
 /*----------------------------------------------------------------------
- * hid.write(dev, report_id, report)
- * dev:write(report_id, report)
- *      report_id       - report ID of this write
- *      report          - report data as a string
- * hid.write(dev, report)
- * dev:write(report)
- *      a report ID of 0 is implied if it is left out
- *      report          - report data as a string
- * Returns bytes sent if successful, nil on failure.
+ * GC method for HidDevice_Obj
  *----------------------------------------------------------------------
  */
 
-static int hidapi_write(lua_State *L)
+static int hidapi_hiddevice_meta_gc(lua_State *L)
 {
-    int res;
-    char *rdata;
-    size_t rsize;
-    size_t txsize;
-    unsigned int i;
-    unsigned char *txdata;
-    HidDevice_Obj *o = check_HidDevice_Obj(L);
-    int n = lua_gettop(L);  /* number of arguments */
-    int rid = 0;
-    int rsrc = 3;
+    HidDevice_Obj *o = to_HidDevice_Obj(L);
+    dev_detach(o);
+    return 0;
+}
 
-    if (n == 2 && lua_isstring(L, 2)) {
-        /* no report ID, report only */
-        rsrc = 2;
-    } else {
-        /* report ID and report */
-        rid = luaL_checkinteger(L, 2);
-    }
-    rdata = (char *)luaL_checklstring(L, rsrc, &rsize);
+/*----------------------------------------------------------------------
+ * definitions for HID report subscription object
+ * - reads a ring published by another process with dev:publish()
+ *----------------------------------------------------------------------
+ */
 
-    /* report ID range check */
-    if (rid < 0 || rid > 0xFF)
-        goto error_handler;
+#define HIDAPI_LIB_HIDSUB       "HIDAPI_HIDSUB"
 
-    /* prepare buffer for report transmit */
-    txsize = rsize + 1;
-    txdata = (unsigned char *)lua_newuserdata(L, txsize);
-    txdata[0] = rid;
-    for (i = 0; i < rsize; i++)
-        txdata[i + 1] = rdata[i];
+typedef struct HidSub_Obj {
+#ifdef HIDAPI_HAVE_SHM
+    HidShmHeader *hdr;          /* NULL once closed */
+    size_t mapsize;
+    uint64_t next;              /* next report number to read */
+    HidShmHeader layout;        /* validated copy of the ring geometry */
+#else
+    void *hdr;
+#endif
+} HidSub_Obj;
 
-    /* send */
-    res = hid_write(o->device, txdata, txsize);
-    if (res < 0)
+#define to_HidSub_Obj(L) ((HidSub_Obj *)luaL_checkudata(L, 1, HIDAPI_LIB_HIDSUB))
+
+/* validate object type and existence
+ */
+static HidSub_Obj *check_HidSub_Obj(lua_State *L)
+{
+    HidSub_Obj *o = to_HidSub_Obj(L);
+    if (o->hdr == NULL)
+        luaL_error(L, "attempt to use a closed object");
+    return o;
+}
+
+/*----------------------------------------------------------------------
+ * sub = hid.subscribe(name)
+ * Maps a report ring published by another process with dev:publish().
+ * Reading starts with the next report published.
+ * Not available on Windows.
+ * Returns a subscription object if successful, nil on failure.
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_subscribe(lua_State *L)
+{
+#ifdef HIDAPI_HAVE_SHM
+    char sname[HIDSHM_NAME_MAXLEN + 2];
+    HidShmHeader *h, l;
+    HidSub_Obj *o;
+    struct stat st;
+    int fd;
+
+    shm_name(sname, luaL_checkstring(L, 1));
+    fd = shm_open(sname, O_RDWR, 0);
+    if (fd < 0)
         goto error_handler;
-    lua_pushinteger(L, res);
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(HidShmHeader)) {
+        close(fd);
+        goto error_handler;
+    }
+    h = (HidShmHeader *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+        goto error_handler;
+    /* the header is writable by any process with access; validate a
+     * copy of the geometry and use only that from here on
+     */
+    l.magic = atomic_get(&h->magic);
+    atomic_fence();
+    memcpy(&l, h, sizeof(l));
+    if (l.magic != HIDSHM_MAGIC || l.version != HIDSHM_VERSION ||
+        l.capacity == 0 || (l.capacity & (l.capacity - 1)) != 0 ||
+        l.slot_size > HID_REPORT_MAXLEN ||
+        l.stride < offsetof(HidShmSlot, data) + l.slot_size ||
+        sizeof(HidShmHeader) + (size_t)l.capacity * l.stride > (size_t)st.st_size) {
+        munmap(h, st.st_size);
+        goto error_handler;
+    }
+
+    /* prepare object */
+    o = (HidSub_Obj *)lua_newuserdata(L, sizeof(HidSub_Obj));
+    o->hdr = h;
+    o->mapsize = st.st_size;
+    o->next = atomic_get(&h->head);
+    o->layout = l;
+    luaL_getmetatable(L, HIDAPI_LIB_HIDSUB);
+    lua_setmetatable(L, -2);
     return 1;
 
 error_handler:
+#endif
     lua_pushnil(L);
     return 1;
 }
 
 /*----------------------------------------------------------------------
- * hid.read(dev, report_size[, timeout_msec])
- * dev:read(report_size[, timeout_msec])
- *      report_size     - size of the read report buffer
- *      timeout_msec    - optional timeout in milliseconds
- * If device has multiple reports, the first byte returned will be the
- * report ID and one extra byte need to be allocated via report_size.
- * For a normal call, timeout_msec can be omitted and blocking will
- * depend on the selected option setting.
- * Specifying a timeout_msec of -1 selects a blocking wait.
- * Returns report as a string if successful, nil on failure.
+ * sub:read([timeout_msec])
+ *      timeout_msec    - optional, -1 (default) waits forever, 0 polls
+ * Returns the next report as a string, its timestamp (see hid.clock())
+ * and its sequence number, which has gaps if the reader fell more than
+ * the ring capacity behind; returns an empty string on timeout.
  *----------------------------------------------------------------------
  */
 
-static int hidapi_read(lua_State *L)
+static int hidapi_sub_read(lua_State *L)
 {
-    int res;
-    int timeout = 0;
-    int using_timeout = 0;
-    unsigned char *rxdata;
-    HidDevice_Obj *o = check_HidDevice_Obj(L);
-    int n = lua_gettop(L);  /* number of arguments */
+#ifdef HIDAPI_HAVE_SHM
+    unsigned char data[HID_REPORT_MAXLEN];
+    HidSub_Obj *o = check_HidSub_Obj(L);
+    HidShmHeader *h = o->hdr;
+    const HidShmHeader *l = &o->layout;
+    int timeout = luaL_optinteger(L, 2, -1);
+    double deadline = clock_msec() + timeout;
 
-    int rxsize = luaL_checkinteger(L, 2);
-    if (rxsize < 0)
-        goto error_handler;
+    for (;;) {
+        uint64_t head;
+        uint32_t wake = atomic_get(&h->wake);
 
-    if (n == 3) {               /* get optional timeout */
-        using_timeout = 1;
-        timeout = luaL_checkinteger(L, 3);
-    }
+        head = atomic_get(&h->head);
+        if (head - o->next > l->capacity)   /* fell behind, skip ahead */
+            o->next = head - l->capacity;
+        while (o->next < head) {
+            HidShmSlot *sl = shm_slot_in(h, l, o->next);
+            uint64_t want = 2 * o->next + 2;
+            uint64_t s1 = atomic_get(&sl->seq);
+            double time;
+            uint32_t size;
 
-    /* prepare buffer for report receive */
-    rxdata = (unsigned char *)lua_newuserdata(L, rxsize);
+            if (s1 == want) {
+                size = sl->size;
+                if (size > l->slot_size)
+                    size = l->slot_size;
+                memcpy(data, sl->data, size);
+                time = sl->time;
+                atomic_fence();
+                if (atomic_get(&sl->seq) == want) {
+                    lua_pushlstring(L, (char *)data, size);
+                    lua_pushnumber(L, time);
+                    lua_pushnumber(L, (lua_Number)(o->next + 1));
+                    o->next++;
+                    return 3;
+                }
+            }
+            o->next++;          /* overwritten, lost */
+        }
 
-    /* receive */
-    if (using_timeout) {
-        res = hid_read_timeout(o->device, rxdata, rxsize, timeout);
-    } else {
-        res = hid_read(o->device, rxdata, rxsize);
+        if (timeout >= 0) {
+            double left = deadline - clock_msec();
+            if (left <= 0) {
+                lua_pushliteral(L, "");
+                return 1;
+            }
+            shm_sleep(h, wake, (int)left + 1);
+        } else {
+            shm_sleep(h, wake, -1);
+        }
     }
-    if (res < 0)
-        goto error_handler;
-    lua_pushlstring(L, (char *)rxdata, res);
-    return 1;
-
-error_handler:
+#else
+    (void)check_HidSub_Obj(L);
     lua_pushnil(L);
     return 1;
+#endif
 }
 
 /*----------------------------------------------------------------------
- * hid.set(dev, option)
- * dev:set(option)
- * Set device options:
- *      "block"   - reads will block
- *      "noblock" - reads will return immediately even if no data
- * Returns true if successful, nil on failure.
+ * sub:close()
+ * Close subscription object. Always succeeds.
  *----------------------------------------------------------------------
  */
 
-enum {
-    DEV_SET_BLOCK = 0,
-    DEV_SET_NOBLOCK
-};
+static int hidapi_sub_close(lua_State *L)
+{
+    HidSub_Obj *o = check_HidSub_Obj(L);
+#ifdef HIDAPI_HAVE_SHM
+    munmap(o->hdr, o->mapsize);
+#endif
+    o->hdr = NULL;
+    return 0;
+}
 
-static int hidapi_set(lua_State *L)
+/*----------------------------------------------------------------------
+ * GC method for HidSub_Obj
+ *----------------------------------------------------------------------
+ */
+
+static int hidapi_sub_meta_gc(lua_State *L)
 {
-    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidSub_Obj *o = to_HidSub_Obj(L);
+#ifdef HIDAPI_HAVE_SHM
+    if (o->hdr)
+        munmap(o->hdr, o->mapsize);
+#endif
+    o->hdr = NULL;
+    return 0;
+}
 
-    static const char *const settings[] = {
-        "block", "noblock", NULL
-    };
-    int op = luaL_checkoption(L, 2, NULL, settings);
+/*----------------------------------------------------------------------
+ * register and create metatable for HIDSUB object
+ *----------------------------------------------------------------------
+ */
 
-    /* prepare parameter for blocking setting */
-    int nonblock = 0;
-    if (op == DEV_SET_NOBLOCK)
-        nonblock = 1;
+static const struct luaL_reg hidsub_meta_reg[] = {
+    {"read",  hidapi_sub_read},
+    {"close", hidapi_sub_close},
+    {"__gc",  hidapi_sub_meta_gc},
+    {NULL, NULL},
+};
 
-    /* perform blocking setting */
-    if (hid_set_nonblocking(o->device, nonblock) < 0) {
-        lua_pushnil(L);
-    } else {
-        lua_pushboolean(L, TRUE);
-    }
-    return 1;
+static void hidapi_create_hidsub_obj(lua_State *L) {
+    luaL_newmetatable(L, HIDAPI_LIB_HIDSUB);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, hidsub_meta_reg);
 }
 
 /*----------------------------------------------------------------------
- * hid.getstring(dev, option)
- * dev:getstring(option)
- * Get device string options:
- *      "manufacturer"  - manufacturer string
- *      "product"       - product string
- *      "serial"        - serial string
- *      or an integer signifying a string index
- * Returns the string if successful, nil on failure.
- * String are forcibly converted to ASCII.
+ * definitions for HID device group object
+ * - broadcasts a write or feature report to all member devices at
+ *   once; a small worker pool, started with the group, claims members
+ *   one at a time and the calling thread joins in
+ * - members are ordinary device objects, kept alive by the group
  *----------------------------------------------------------------------
  */
 
-enum {
-    DEV_GETSTR_MANUFACTURER = 0,
-    DEV_GETSTR_PRODUCT,
-    DEV_GETSTR_SERIAL_NUMBER
-};
+#define HIDAPI_LIB_HIDGROUP     "HIDAPI_HIDGROUP"
+#define HIDGROUP_MAX_WORKERS    8
 
-static int hidapi_getstring(lua_State *L)
+typedef struct HidGroup_Obj {
+    int count;                  /* number of members, 0 once closed */
+    int nworkers;
+    HidDevice_Obj **member;
+    int *result;                /* per member, of the last transfer */
+    double *elapsed;
+    hid_thread_t worker[HIDGROUP_MAX_WORKERS];
+    hid_mutex_t lock;
+    hid_cond_t cond;            /* wakes workers for a new transfer */
+    hid_cond_t done;            /* wakes the caller when all finished */
+    unsigned long gen;          /* transfer generation, under lock */
+    int stop;                   /* under lock */
+    volatile long next;         /* next member to claim */
+    volatile long busy;         /* members not yet finished */
+    int feature;                /* transfer: feature report or write */
+    const unsigned char *data;
+    int size;
+} HidGroup_Obj;
+
+#define to_HidGroup_Obj(L) ((HidGroup_Obj *)luaL_checkudata(L, 1, HIDAPI_LIB_HIDGROUP))
+
+/* validate object type and existence
+ */
+static HidGroup_Obj *check_HidGroup_Obj(lua_State *L)
 {
-    wchar_t ws[USB_STR_MAXLEN] = {0};
-    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidGroup_Obj *g = to_HidGroup_Obj(L);
+    if (g->count == 0)
+        luaL_error(L, "attempt to use a closed object");
+    return g;
+}
 
-    static const char *const settings[] = {
-        "manufacturer", "product", "serial_number", NULL
-    };
+/* claim and serve members until none are left
+ */
+static void group_run(HidGroup_Obj *g)
+{
+    long i;
 
-    if (lua_isnumber(L, 2)) {
-        /* indexed USB strings */
-        int strid = luaL_checkinteger(L, 2);
-        if (hid_get_indexed_string(o->device, strid, ws, USB_STR_MAXLEN) < 0) {
-            goto error_handler;
-        }
-    } else {
-        /* named (standard) USB strings */
-        int op = luaL_checkoption(L, 2, NULL, settings);
-        if (op == DEV_GETSTR_MANUFACTURER) {
-            if (hid_get_manufacturer_string(o->device, ws, USB_STR_MAXLEN) < 0) {
-                goto error_handler;
-            }
-        } else if (op == DEV_GETSTR_PRODUCT) {
-            if (hid_get_product_string(o->device, ws, USB_STR_MAXLEN) < 0) {
-                goto error_handler;
-            }
-        } else { /* (op == DEV_GETSTR_SERIAL_NUMBER) */
-            if (hid_get_serial_number_string(o->device, ws, USB_STR_MAXLEN) < 0) {
-                goto error_handler;
+    while ((i = atomic_inc(&g->next) - 1) < g->count) {
+        HidDevice_Obj *o = g->member[i];
+        double t0 = clock_msec();
+        int res = -1;
+
+        if (o->device) {
+            if (!g->feature && coalesce_put(o->core, g->data, g->size) == 0) {
+                res = g->size;
+            } else {
+                dev_lock(o);
+                if (g->feature)
+                    res = hid_send_feature_report(o->device, g->data, g->size);
+                else
+                    res = hid_write(o->device, g->data, g->size);
+                dev_unlock(o);
             }
         }
+        g->result[i] = res;
+        g->elapsed[i] = clock_msec() - t0;
+        if (atomic_dec(&g->busy) == 0) {
+            mutex_lock(&g->lock);
+            cond_signal(&g->done);
+            mutex_unlock(&g->lock);
+        }
     }
-    push_forced_ascii(L, ws);
-    return 1;
+}
 
-error_handler:
-    lua_pushnil(L);
-    return 1;
+static THREAD_FUNC(group_worker)
+{
+    HidGroup_Obj *g = (HidGroup_Obj *)arg;
+    unsigned long seen = 0;
+
+    mutex_lock(&g->lock);
+    for (;;) {
+        while (!g->stop && g->gen == seen)
+            cond_wait_msec(&g->cond, &g->lock, -1);
+        if (g->stop)
+            break;
+        seen = g->gen;
+        mutex_unlock(&g->lock);
+        group_run(g);
+        mutex_lock(&g->lock);
+    }
+    mutex_unlock(&g->lock);
+    THREAD_RETURN;
+}
+
+/* run one transfer on all members and wait for it to finish
+ */
+static void group_dispatch(HidGroup_Obj *g, int feature, const unsigned char *data, int size)
+{
+    g->feature = feature;
+    g->data = data;
+    g->size = size;
+    atomic_set(&g->busy, g->count);
+    atomic_set(&g->next, 0);    /* last, a straggler may claim at once */
+    mutex_lock(&g->lock);
+    g->gen++;
+    cond_broadcast(&g->cond);
+    mutex_unlock(&g->lock);
+
+    group_run(g);
+    mutex_lock(&g->lock);
+    while (atomic_get(&g->busy) > 0)
+        cond_wait_msec(&g->done, &g->lock, -1);
+    mutex_unlock(&g->lock);
+}
+
+static void group_free(HidGroup_Obj *g)
+{
+    int i;
+
+    mutex_lock(&g->lock);
+    g->stop = 1;
+    cond_broadcast(&g->cond);
+    mutex_unlock(&g->lock);
+    for (i = 0; i < g->nworkers; i++)
+        thread_join(g->worker[i]);
+    g->nworkers = 0;
+    cond_destroy(&g->done);
+    cond_destroy(&g->cond);
+    mutex_destroy(&g->lock);
+    free(g->member);
+    free(g->result);
+    free(g->elapsed);
+    g->member = NULL;
+    g->count = 0;
 }
 
 /*----------------------------------------------------------------------
- * hid.setfeature(dev, feature_id, feature_data)
- * dev:setfeature(feature_id, feature_data)
- *      feature_id      - feature report ID, 1-byte range
- *      feature_data    - string containing feature report data
- * Set (send) a feature report. A 0 is used for a single report ID.
- * Returns bytes sent if successful, nil on failure.
+ * group = hid.group{dev1, dev2, ...}
+ * Creates a group of open device objects for broadcast transfers.
+ * Members stay usable on their own; closing one only makes its
+ * results in the group fail.
+ * Returns a group object if successful, nil on failure.
  *----------------------------------------------------------------------
  */
 
-static int hidapi_setfeature(lua_State *L)
+static int hidapi_group(lua_State *L)
 {
-    int res;
-    char *fdata;
-    size_t fsize;
-    size_t txsize;
-    unsigned int i;
-    unsigned char *txdata;
-    HidDevice_Obj *o = check_HidDevice_Obj(L);
-
-    /* feature report ID check */
-    int fid = luaL_checkinteger(L, 2);
-    if (fid < 0 || fid > 0xFF)
-        goto error_handler;
+    HidGroup_Obj *g;
+    int i, n;
 
-    fdata = (char *)luaL_checklstring(L, 3, &fsize);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = (int)lua_objlen(L, 1);
+    if (n <= 0)
+        return luaL_argerror(L, 1, "empty group");
 
-    /* prepare buffer for report transmit */
-    txsize = fsize + 1;
-    txdata = (unsigned char *)lua_newuserdata(L, txsize);
-    txdata[0] = fid;
-    for (i = 0; i < fsize; i++)
-        txdata[i + 1] = fdata[i];
+    /* members, kept alive through the environment table */
+    lua_createtable(L, n, 0);
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        if (!lua_getmetatable(L, -1))
+            luaL_error(L, "group member %d is not a device object", i);
+        luaL_getmetatable(L, HIDAPI_LIB_HIDDEVICE);
+        if (!lua_rawequal(L, -1, -2))
+            luaL_error(L, "group member %d is not a device object", i);
+        lua_pop(L, 2);
+        lua_rawseti(L, -2, i);
+    }
 
-    /* send */
-    res = hid_send_feature_report(o->device, txdata, txsize);
-    if (res < 0)
-        goto error_handler;
-    lua_pushinteger(L, res);
-    return 1;
+    /* prepare object */
+    g = (HidGroup_Obj *)lua_newuserdata(L, sizeof(HidGroup_Obj));
+    memset(g, 0, sizeof(HidGroup_Obj));
+    g->member = (HidDevice_Obj **)calloc(n, sizeof(HidDevice_Obj *));
+    g->result = (int *)calloc(n, sizeof(int));
+    g->elapsed = (double *)calloc(n, sizeof(double));
+    if (!g->member || !g->result || !g->elapsed) {
+        free(g->member);
+        free(g->result);
+        free(g->elapsed);
+        lua_pushnil(L);
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -2, i + 1);
+        g->member[i] = (HidDevice_Obj *)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+    }
+    g->count = n;
+    mutex_init(&g->lock);
+    cond_init(&g->cond);
+    cond_init(&g->done);
+    lua_pushvalue(L, -2);
+    lua_setfenv(L, -2);
+    luaL_getmetatable(L, HIDAPI_LIB_HIDGROUP);
+    lua_setmetatable(L, -2);
 
-error_handler:
-    lua_pushnil(L);
+    /* the caller serves one member itself */
+    while (g->nworkers < n - 1 && g->nworkers < HIDGROUP_MAX_WORKERS) {
+        if (thread_start(&g->worker[g->nworkers], group_worker, g) != 0)
+            break;
+        g->nworkers++;
+    }
     return 1;
 }
 
-/*----------------------------------------------------------------------
- * hid.getfeature(dev, feature_id, feature_size)
- * dev:getfeature(feature_id, feature_size)
- *      feature_id      - feature report ID, 1-byte range
- *      feature_size    - size of read buffer, may be larger than the
- *                        actual feature report
- * Get a feature report. A 0 is used for a single report ID.
- * Returns feature report as a string if successful, nil on failure.
- *----------------------------------------------------------------------
+/* run a transfer from the Lua arguments (report_id, data) and push
+ * the results and timings tables
  */
-
-static int hidapi_getfeature(lua_State *L)
+static int group_transfer(lua_State *L, int feature)
 {
-    int res;
-    int fsize;
-    size_t rxsize;
-    unsigned char *rxdata;
-    HidDevice_Obj *o = check_HidDevice_Obj(L);
+    HidGroup_Obj *g = check_HidGroup_Obj(L);
+    int n = lua_gettop(L);  /* number of arguments */
+    unsigned char *txdata;
+    const char *rdata;
+    size_t rsize;
+    int i, rid = 0, rsrc = 3;
 
-    /* feature report ID check */
-    int fid = luaL_checkinteger(L, 2);
-    if (fid < 0 || fid > 0xFF)
-        goto error_handler;
+    if (!feature && n == 2 && lua_isstring(L, 2)) {
+        /* no report ID, report only */
+        rsrc = 2;
+    } else {
+        rid = luaL_checkinteger(L, 2);
+    }
+    rdata = luaL_checklstring(L, rsrc, &rsize);
+    if (rid < 0 || rid > 0xFF || rsize > HID_REPORT_MAXLEN) {
+        lua_pushnil(L);
+        return 1;
+    }
 
-    fsize = luaL_checkinteger(L, 3);
-    if (fsize < 0)
-        goto error_handler;
+    /* prepare buffer for report transmit */
+    txdata = (unsigned char *)lua_newuserdata(L, rsize + 1);
+    txdata[0] = rid;
+    memcpy(txdata + 1, rdata, rsize);
+    group_dispatch(g, feature, txdata, (int)rsize + 1);
 
-    /* prepare buffer for report receive */
-    rxsize = fsize + 1;
-    rxdata = (unsigned char *)lua_newuserdata(L, rxsize);
-    rxdata[0] = fid;
+    lua_createtable(L, g->count, 0);
+    lua_createtable(L, g->count, 0);
+    for (i = 0; i < g->count; i++) {
+        if (g->result[i] < 0)
+            lua_pushboolean(L, 0);
+        else
+            lua_pushinteger(L, g->result[i]);
+        lua_rawseti(L, -3, i + 1);
+        lua_pushnumber(L, g->elapsed[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 2;
+}
 
-    /* receive */
-    res = hid_get_feature_report(o->device, rxdata, rxsize);
-    if (res < 0)
-        goto error_handler;
-    lua_pushlstring(L, (char *)rxdata, res);
-    return 1;
+/*----------------------------------------------------------------------
+ * group:write(report_id, report)
+ * group:write(report)
+ *      as dev:write(), sent to all members concurrently
+ * Returns a table with the result per member, in group order: bytes
+ * sent, or false if the member failed or is closed, and a table with
+ * the time each member took in milliseconds; nil on failure.
+ *----------------------------------------------------------------------
+ */
 
-error_handler:
-    lua_pushnil(L);
-    return 1;
+static int hidapi_group_write(lua_State *L)
+{
+    return group_transfer(L, 0);
 }
 
 /*----------------------------------------------------------------------
- * hid.error(dev)
- * dev:error()
- * Returns a string describing the last error, or nil if there was no
- * error. Error string is forcibly converted to ASCII.
+ * group:setfeature(feature_id, feature_data)
+ *      as dev:setfeature(), sent to all members concurrently
+ * Returns results and timings as group:write().
  *----------------------------------------------------------------------
  */
 
-static int hidapi_error(lua_State *L)
+static int hidapi_group_setfeature(lua_State *L)
 {
-    HidDevice_Obj *o = check_HidDevice_Obj(L);
-    if (o->device) {
-        const wchar_t *err = hid_error(o->device);
-        if (err) {
-            push_forced_ascii(L, err);
-            return 1;
-        }
-    }
-    lua_pushnil(L);
-    return 1;
+    return group_transfer(L, 1);
 }
 
 /*----------------------------------------------------------------------
- * hid.close(dev)
- * dev:close()
- * Close HID device object. Always succeeds.
+ * group:close()
+ * Stop the worker pool and release the members. The member device
+ * objects are not closed. Always succeeds.
  *----------------------------------------------------------------------
  */
 
-static int hidapi_close(lua_State *L)
+static int hidapi_group_close(lua_State *L)
 {
-    HidDevice_Obj *o = check_HidDevice_Obj(L);
-    if (o->device) {
-        hid_close(o->device);
-    }
-    o->device = NULL;
+    HidGroup_Obj *g = check_HidGroup_Obj(L);
+    group_free(g);
+    lua_newtable(L);
+    lua_setfenv(L, 1);
     return 0;
 }
 
 /*----------------------------------------------------------------------
- * GC method for HidDevice_Obj
+ * GC method for HidGroup_Obj
  *----------------------------------------------------------------------
  */
 
-static int hidapi_hiddevice_meta_gc(lua_State *L)
+static int hidapi_group_meta_gc(lua_State *L)
 {
-    HidDevice_Obj *o = to_HidDevice_Obj(L);
-    if (o->device) {
-        hid_close(o->device);
-    }
-    o->device = NULL;
+    HidGroup_Obj *g = to_HidGroup_Obj(L);
+    if (g->count)
+        group_free(g);
     return 0;
 }
 
+/*----------------------------------------------------------------------
+ * register and create metatable for HIDGROUP object
+ *----------------------------------------------------------------------
+ */
+
+static const struct luaL_reg hidgroup_meta_reg[] = {
+    {"write", hidapi_group_write},
+    {"setfeature", hidapi_group_setfeature},
+    {"close", hidapi_group_close},
+    {"__gc",  hidapi_group_meta_gc},
+    {NULL, NULL},
+};
+
+static void hidapi_create_hidgroup_obj(lua_State *L) {
+    luaL_newmetatable(L, HIDAPI_LIB_HIDGROUP);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, hidgroup_meta_reg);
+}
+
 /*----------------------------------------------------------------------
  * hid.msleep(milliseconds)
  * A convenience sleep function. Time is specified in milliseconds.
@@ -742,12 +4056,7 @@ static int hidapi_hiddevice_meta_gc(lua_State *L)
 static int hidapi_msleep(lua_State *L)
 {
     int msec = luaL_checkinteger(L, 1);
-
-#ifdef WIN32
-    Sleep(msec);
-#else
-    usleep(msec * 1000);
-#endif
+    sys_msleep(msec);
     return 0;
 }
 
@@ -760,10 +4069,21 @@ static const struct luaL_reg hiddevice_meta_reg[] = {
     {"write", hidapi_write},
     {"read", hidapi_read},
     {"set", hidapi_set},
+    {"latest", hidapi_latest},
     {"getstring", hidapi_getstring},
     {"setfeature", hidapi_setfeature},
     {"getfeature", hidapi_getfeature},
     {"error", hidapi_error},
+    {"waitfor", hidapi_waitfor},
+    {"sendblob", hidapi_sendblob},
+    {"setfilter", hidapi_setfilter},
+    {"stats", hidapi_stats},
+    {"aggregate", hidapi_aggregate},
+    {"summary", hidapi_summary},
+    {"demux", hidapi_demux},
+    {"coalesce", hidapi_coalesce},
+    {"publish", hidapi_publish},
+    {"share", hidapi_share},
     {"close", hidapi_close},
     {"__gc",  hidapi_hiddevice_meta_gc},
     {NULL, NULL},
@@ -789,12 +4109,28 @@ static const struct luaL_reg hidapi_func_list[] = {
     {"write", hidapi_write},
     {"read", hidapi_read},
     {"set", hidapi_set},
+    {"latest", hidapi_latest},
     {"getstring", hidapi_getstring},
     {"setfeature", hidapi_setfeature},
     {"getfeature", hidapi_getfeature},
     {"error", hidapi_error},
+    {"waitfor", hidapi_waitfor},
+    {"sendblob", hidapi_sendblob},
+    {"setfilter", hidapi_setfilter},
+    {"stats", hidapi_stats},
+    {"aggregate", hidapi_aggregate},
+    {"summary", hidapi_summary},
+    {"demux", hidapi_demux},
+    {"coalesce", hidapi_coalesce},
+    {"publish", hidapi_publish},
+    {"share", hidapi_share},
+    {"attach", hidapi_attach},
+    {"subscribe", hidapi_subscribe},
+    {"group", hidapi_group},
+    {"columns", hidapi_columns},
     {"close", hidapi_close},
     {"msleep", hidapi_msleep},
+    {"clock", hidapi_clock},
     {NULL, NULL},
 };
 
@@ -809,6 +4145,10 @@ HIDAPI_API int luaopen_luahidapi(lua_State *L)
     hidapi_create_hidenum_obj(L);
     /* device handle metatable */
     hidapi_create_hiddevice_obj(L);
+    /* subscription metatable */
+    hidapi_create_hidsub_obj(L);
+    /* device group metatable */
+    hidapi_create_hidgroup_obj(L);
     /* library */
     luaL_register(L, MODULE_NAMESPACE, hidapi_func_list);
 